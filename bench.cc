@@ -0,0 +1,572 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(HAVE_LIBDEFLATE)
+#include <libdeflate.h>
+#endif
+
+#include "stuffer.h"
+#include "checksum.h"
+#include "defl8bit.h"
+#include "ml.h"
+#include "compiled.h"
+#include "catfacts.h"
+
+namespace {
+
+// Something the optimiser can't see through, to keep results alive.
+volatile uint32_t sink;
+
+static constexpr size_t kBufferLimit = 0x100000;
+static constexpr size_t kBufferSize = kBufferLimit + 0x4000;
+
+// Hardware counters for this thread, where the kernel allows it.
+class PerfCounters {
+   public:
+    enum { kCycles, kInstructions, kL1Misses, kLLCMisses, kCount };
+
+    PerfCounters() {
+        open(kCycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        open(kInstructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        open(kL1Misses, PERF_TYPE_HW_CACHE,
+             PERF_COUNT_HW_CACHE_L1D
+             | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+             | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        open(kLLCMisses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    }
+    ~PerfCounters() {
+        for (int fd : fd_) if (fd >= 0) close(fd);
+    }
+
+    bool available(int i) const { return fd_[i] >= 0; }
+    uint64_t operator[](int i) const { return value_[i]; }
+
+    void start() {
+        for (int fd : fd_) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    void stop() {
+        for (int i = 0; i < kCount; ++i) {
+            if (fd_[i] < 0) continue;
+            ioctl(fd_[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd_[i], &value_[i], sizeof(value_[i])) != sizeof(value_[i])) {
+                value_[i] = 0;
+            }
+        }
+    }
+
+   private:
+    void open(int i, uint32_t type, uint64_t config) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    int fd_[kCount];
+    uint64_t value_[kCount] = {};
+};
+
+uint64_t timestamp() {
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+struct Volume {
+    uint64_t in;   // uncompressed bytes represented
+    uint64_t out;  // bytes actually emitted, where that means something
+};
+
+size_t volume_bytes = 64 << 20;
+
+void report_header(PerfCounters const& perf) {
+    printf("%-28s %9s %7s %5s %9s %9s %6s\n", "", "MB/s", "cyc/B",
+           "IPC", "L1miss/K", "LLCmiss/K", "ratio");
+    if (!perf.available(PerfCounters::kCycles)) {
+        printf("(no perf counters here; cyc/B is TSC reference cycles)\n");
+    }
+}
+
+// Run f twice (the first to warm up), and report throughput in terms of
+// the uncompressed bytes it says it covered.
+void measure(PerfCounters& perf, char const* name, std::function<Volume()> f) {
+    f();
+    auto start = std::chrono::steady_clock::now();
+    uint64_t tsc = timestamp();
+    perf.start();
+    Volume v = f();
+    perf.stop();
+    tsc = timestamp() - tsc;
+    auto stop = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(stop - start).count();
+    double bytes = double(v.in);
+
+    printf("%-28s %9.1f", name, bytes / seconds / 1e6);
+    if (perf.available(PerfCounters::kCycles)) {
+        printf(" %7.3f", perf[PerfCounters::kCycles] / bytes);
+    } else if (tsc != 0) {
+        printf(" %7.3f", tsc / bytes);
+    } else {
+        printf(" %7s", "-");
+    }
+    if (perf.available(PerfCounters::kCycles) && perf.available(PerfCounters::kInstructions)) {
+        printf(" %5.2f", double(perf[PerfCounters::kInstructions]) / perf[PerfCounters::kCycles]);
+    } else {
+        printf(" %5s", "-");
+    }
+    for (int i : {PerfCounters::kL1Misses, PerfCounters::kLLCMisses}) {
+        if (perf.available(i)) {
+            printf(" %9.3f", perf[i] * 1024.0 / bytes);
+        } else {
+            printf(" %9s", "-");
+        }
+    }
+    if (v.out != 0) {
+        printf(" %6.3f", double(v.out) / v.in);
+    }
+    printf("\n");
+}
+
+// Run decode(enc) until it has covered volume_bytes of text.
+template <typename T, typename F>
+Volume grammar_volume(F&& decode) {
+    std::vector<uint8_t> buffer(kBufferSize);
+    T enc(buffer);
+    enc.seed(1);
+    uint64_t done = 0, out = 0;
+    uint32_t last = 0;
+    while (done < volume_bytes) {
+        decode(enc);
+        uint32_t position = std::get<0>(enc.tell());
+        done += uint32_t(position - last);
+        last = position;
+        if (enc.size() >= kBufferLimit) {
+            out += enc.size();
+            enc.reset();
+        }
+    }
+    out += enc.size();
+    return {done, out};
+}
+
+// Whole responses of about `length` bytes of text, each from a fresh
+// encoder with its container's head and tail, so the ratio counts the
+// framing too.
+template <typename T>
+Volume response_volume(size_t length) {
+    std::vector<uint8_t> buffer(length * 2 + 0x4000);
+    uint64_t done = 0, out = 0;
+    for (uint64_t seed = 1; done < volume_bytes; ++seed) {
+        T enc(buffer);
+        enc.head();
+        enc.seed(seed);
+        while (std::get<0>(enc.tell()) < length) catfacts.do_something(enc);
+        enc.tail();
+        done += std::get<0>(enc.tell());
+        out += enc.size();
+    }
+    return {done, out};
+}
+
+// A short word per n, to fill out a synthetic grammar.
+struct Word {
+    char text[8] = {};
+    size_t length = 0;
+    constexpr Word(uint32_t n) {
+        do {
+            text[length++] = char('a' + n % 26);
+            n /= 26;
+        } while (n != 0);
+        text[length++] = ' ';
+    }
+    constexpr operator std::string_view() const { return {text, length}; }
+};
+
+// A grammar far larger than catfacts, to see how the backends scale with
+// code size: kLayers layers of kWidth picks, each over sequences which
+// call into the layer below.
+template <typename T>
+constexpr ML::GenBuilder<T> synthetic() {
+    constexpr int kLayers = 8;
+    constexpr int kWidth = 32;
+    ML::GenBuilder<T> ml;
+    ML::MLPtr below[kWidth];
+    uint32_t n = 0;
+    for (auto& p : below) {
+        p = ml.pick(Word(n), Word(n + 1), Word(n + 2), Word(n + 3));
+        n += 4;
+    }
+    for (int layer = 1; layer < kLayers; ++layer) {
+        ML::MLPtr here[kWidth];
+        for (int j = 0; j < kWidth; ++j) {
+            auto a = below[(j * 7 + 1) % kWidth];
+            auto b = below[(j * 5 + 2) % kWidth];
+            auto c = below[(j * 3 + 3) % kWidth];
+            here[j] = ml.pick(ml(Word(n), a, Word(n + 1)),
+                              ml(b, Word(n + 2)),
+                              ml(Word(n + 3), c),
+                              Word(n + 4));
+            n += 5;
+        }
+        std::copy(std::begin(here), std::end(here), std::begin(below));
+    }
+    ml.set_entry(ml(ml.pick(below[0], below[5], below[10], below[15],
+                            below[20], below[25], below[30], below[31]),
+                    "\n"));
+    return ml;
+}
+
+constexpr auto synthetic_tmp = synthetic<GZip>();
+constexpr auto synthetic_pack = synthetic_tmp.make_pack<synthetic_tmp.sizes()>();
+const ML::Generator<GZip> synthetic_gen{synthetic_pack};
+
+// The same with 2-byte backrefs for short distances.
+constexpr Defl8bitTables near_tables{Defl8bitNearLengths{}};
+using NearGZip = GZipWith<near_tables>;
+constexpr auto synthetic_near_tmp = synthetic<NearGZip>();
+constexpr auto synthetic_near_pack = synthetic_near_tmp.make_pack<synthetic_near_tmp.sizes()>();
+const ML::Generator<NearGZip> synthetic_near_gen{synthetic_near_pack};
+
+EncoderLiteral some_blob(size_t min_length) {
+    auto const& gen = catfacts.gzip_catfacts_;
+    for (size_t i = 0; i < gen.headers_.size(); ++i) {
+        if (gen.headers_[i].length >= min_length) return gen.blob_at(i);
+    }
+    return gen.blob_at(0);
+}
+
+// Emit the same literal over and over, cycling through `indices` literal
+// indices; with one it backrefs every time, and with many the last use is
+// never within the window.
+Volume blob_volume(EncoderLiteral blob, uint16_t indices) {
+    std::vector<uint8_t> buffer(kBufferSize);
+    GZip gz(buffer);
+    uint64_t done = 0, out = 0;
+    for (uint32_t n = 0; done < volume_bytes; ++n) {
+        if (indices > 1) blob.i = n % indices;
+        gz.blob(blob);
+        done += blob.length;
+        if (gz.size() >= kBufferLimit) {
+            out += gz.size();
+            gz.reset();
+        }
+    }
+    out += gz.size();
+    return {done, out};
+}
+
+Volume integer_volume() {
+    std::vector<uint8_t> buffer(kBufferSize);
+    GZip gz(buffer);
+    uint64_t done = 0, out = 0;
+    uint32_t last = 0;
+    uint64_t x = 1;
+    while (done < volume_bytes) {
+        x = x * UINT64_C(6364136223846793005) + 1;
+        gz.integer((x >> 32) % 100000);
+        uint32_t position = std::get<0>(gz.tell());
+        done += uint32_t(position - last);
+        last = position;
+        if (gz.size() >= kBufferLimit) {
+            out += gz.size();
+            gz.reset();
+        }
+    }
+    out += gz.size();
+    return {done, out};
+}
+
+template <typename T_cksum>
+Volume checksum_add_volume() {
+    T_cksum check;
+    for (size_t i = 0; i < volume_bytes; ++i) check.add(uint8_t(i));
+    sink = check.get();
+    return {volume_bytes, 0};
+}
+
+// add(span), for runs of `length` bytes.
+template <typename T_cksum>
+Volume checksum_run_volume(size_t length) {
+    std::vector<uint8_t> run(length);
+    for (size_t i = 0; i < length; ++i) run[i] = uint8_t(i * 7);
+    T_cksum check;
+    for (size_t i = 0; i < volume_bytes; i += length) {
+        run[0] = uint8_t(i);
+        check.add(std::span<const uint8_t>(run));
+    }
+    sink = check.get();
+    return {volume_bytes, 0};
+}
+
+// One ffwd/splice pair per `length` bytes, as blob() does.
+Volume crc_splice_volume(uint32_t length) {
+    CRC32 crc;
+    for (size_t i = 0; i < volume_bytes; i += length) {
+        crc.ffwd(length);
+        crc.splice(uint32_t(i));
+    }
+    sink = crc.get();
+    return {volume_bytes, 0};
+}
+
+template <typename F>
+Volume stuffer_volume(size_t step, F&& write) {
+    std::vector<uint8_t> buffer(kBufferSize);
+    ByteStuffer out(buffer);
+    for (size_t i = 0; i < volume_bytes; i += step) {
+        write(out, uint32_t(i));
+        if (out.size() >= kBufferLimit) {
+            sink = out.begin()[i & 0xffff];
+            out.clear();
+        }
+    }
+    return {volume_bytes, 0};
+}
+
+Volume bitstuffer_volume(int bits) {
+    std::vector<uint8_t> buffer(kBufferSize);
+    uint64_t written = 0;
+    BitStuffer out(buffer);
+    while (written < volume_bytes * 8) {
+        out.wr(bits, written & ((1 << bits) - 1));
+        written += bits;
+        if (out.size() >= kBufferLimit) {
+            out.sync();
+            sink = *out.begin();
+            out = BitStuffer(buffer);
+        }
+    }
+    return {volume_bytes, 0};
+}
+
+// Text for the other libraries to compress, when there are any.
+#if defined(HAVE_ZLIB) || defined(HAVE_LIBDEFLATE)
+std::vector<uint8_t> raw_catfacts() {
+    std::vector<uint8_t> text;
+    std::vector<uint8_t> buffer(kBufferSize);
+    RawData txt(buffer);
+    txt.seed(1);
+    while (text.size() < volume_bytes) {
+        catfacts.do_something(txt);
+        if (txt.size() >= kBufferLimit) {
+            text.insert(text.end(), txt.begin(), txt.end());
+            txt.reset();
+        }
+    }
+    text.insert(text.end(), txt.begin(), txt.end());
+    return text;
+}
+#endif
+
+#if defined(HAVE_ZLIB)
+Volume zlib_volume(std::vector<uint8_t> const& text, int level) {
+    std::vector<uint8_t> out(compressBound(text.size()) + 64);
+    z_stream z{};
+    deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    z.next_in = const_cast<uint8_t*>(text.data());
+    z.avail_in = text.size();
+    z.next_out = out.data();
+    z.avail_out = out.size();
+    deflate(&z, Z_FINISH);
+    uint64_t size = z.total_out;
+    deflateEnd(&z);
+    return {text.size(), size};
+}
+#endif
+
+#if defined(HAVE_LIBDEFLATE)
+Volume libdeflate_volume(std::vector<uint8_t> const& text, int level) {
+    libdeflate_compressor* c = libdeflate_alloc_compressor(level);
+    std::vector<uint8_t> out(libdeflate_gzip_compress_bound(c, text.size()));
+    size_t size = libdeflate_gzip_compress(c, text.data(), text.size(), out.data(), out.size());
+    libdeflate_free_compressor(c);
+    return {text.size(), size};
+}
+#endif
+
+template <typename F>
+double ns_per_op(size_t ops, F&& f) {
+    f();  // warm up
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(stop - start).count() / ops;
+}
+
+std::vector<uint32_t> random_lengths(size_t count, uint32_t range) {
+    std::vector<uint32_t> r(count);
+    uint64_t x = 1;
+    for (auto& n : r) {
+        x = x * UINT64_C(6364136223846793005) + 1;
+        n = ((x >> 32) * range) >> 32;
+    }
+    return r;
+}
+
+void bench_ffwd(size_t iterations) {
+    constexpr size_t kCount = 4096;
+    auto short_n = random_lengths(kCount, CRCTools::tables.kFfwdTableSize);
+    auto long_n = random_lengths(kCount, UINT32_MAX);
+    size_t ops = iterations * kCount;
+
+    // Chain each result into the next call, so this is latency, which is
+    // what the blob path sees.
+    auto run = [&](auto const& lengths, auto&& ffwd) {
+        return ns_per_op(ops, [&]() {
+            uint32_t crc = 1;
+            for (size_t i = 0; i < iterations; ++i) {
+                for (uint32_t n : lengths) crc = ffwd(crc, n);
+            }
+            sink = crc;
+        });
+    };
+    double table = run(short_n, [](uint32_t crc, uint32_t n) {
+        return CRCTools::ffwd_mul(crc, CRCTools::tables.ffwd_[n]);
+    });
+    double general = run(short_n, [](uint32_t crc, uint32_t n) {
+        return CRCTools::ffwd(crc, n);
+    });
+    double long_runs = run(long_n, [](uint32_t crc, uint32_t n) {
+        return CRCTools::ffwd(crc, n);
+    });
+    printf("crc32 ffwd, table lookup (n < %zu):  %6.2f ns\n",
+           CRCTools::tables.kFfwdTableSize, table);
+    printf("crc32 ffwd, general (n < %zu):       %6.2f ns\n",
+           CRCTools::tables.kFfwdTableSize, general);
+    printf("crc32 ffwd, general (n < 2^32):      %6.2f ns\n", long_runs);
+}
+
+}  // namespace
+
+int main(int argc, char * const* argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "l:")) != -1) {
+        switch (opt) {
+        case 'l': volume_bytes = strtoull(optarg, nullptr, 0) << 20;
+            break;
+        default: fprintf(stderr, "Usage: %s [-l megabytes] [scenario-prefix...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    auto wanted = [&](std::string_view name) {
+        if (optind == argc) return true;
+        for (int i = optind; i < argc; ++i) {
+            if (name.starts_with(argv[i])) return true;
+        }
+        return false;
+    };
+
+    PerfCounters perf;
+    report_header(perf);
+    auto run = [&](char const* name, std::function<Volume()> f) {
+        if (wanted(name)) measure(perf, name, std::move(f));
+    };
+
+    run("catfacts gzip", []() {
+        return grammar_volume<CatFactsGZip>([](CatFactsGZip& out) { catfacts.do_something(out); });
+    });
+    // Counts what "catfacts gzip" writes, so the ratio should match.
+    run("catfacts gzip size only", []() {
+        return grammar_volume<CatFactsSize>([](CatFactsSize& out) { catfacts.do_something(out); });
+    });
+    run("catfacts gzip hufftable", []() {
+        return grammar_volume<GZip>([](GZip& out) { catfacts.do_something(out); });
+    });
+    run("catfacts gzip4", []() {
+        return grammar_volume<GZip4>([](GZip4& out) { catfacts.do_something(out); });
+    });
+    run("catfacts raw", []() {
+        return grammar_volume<RawData>([](RawData& out) { catfacts.do_something(out); });
+    });
+#if defined(DEFL8BIT_COMPILED)
+    run("catfacts gzip compiled", []() {
+        return grammar_volume<CatFactsGZip>([](CatFactsGZip& out) { catfacts.do_something_compiled(out); });
+    });
+    run("catfacts gzip4 compiled", []() {
+        return grammar_volume<GZip4>([](GZip4& out) { catfacts.do_something_compiled(out); });
+    });
+    run("catfacts raw compiled", []() {
+        return grammar_volume<RawData>([](RawData& out) { catfacts.do_something_compiled(out); });
+    });
+#endif
+    run("response 256B gzip", []() { return response_volume<GZip>(256); });
+    run("response 256B zlib", []() { return response_volume<ZLib>(256); });
+    run("response 4K gzip", []() { return response_volume<GZip>(4096); });
+    run("response 4K zlib", []() { return response_volume<ZLib>(4096); });
+    run("synthetic gzip", []() {
+        return grammar_volume<GZip>([](GZip& out) { synthetic_gen.decode(out); });
+    });
+    run("synthetic gzip compiled", []() {
+        return grammar_volume<GZip>(ML::Compiled<GZip, synthetic_pack>::decode);
+    });
+    run("synthetic gzip near", []() {
+        return grammar_volume<NearGZip>([](NearGZip& out) { synthetic_near_gen.decode(out); });
+    });
+    run("blob hit", []() { return blob_volume(some_blob(8), 1); });
+    run("blob miss", []() { return blob_volume(some_blob(8), 0x8000); });
+    run("integer", integer_volume);
+    run("crc32 add", checksum_add_volume<CRC32>);
+    run("crc32 add 6B", []() { return checksum_run_volume<CRC32>(6); });
+    run("crc32 add 64B", []() { return checksum_run_volume<CRC32>(64); });
+    run("adler32 add", checksum_add_volume<Adler32>);
+    run("adler32 add 64B", []() { return checksum_run_volume<Adler32>(64); });
+    run("crc32 ffwd+splice 8B", []() { return crc_splice_volume(8); });
+    run("crc32 ffwd+splice 32B", []() { return crc_splice_volume(32); });
+    run("bytestuffer wr1", []() {
+        return stuffer_volume(1, [](ByteStuffer& out, uint32_t x) { out.wr1(x); });
+    });
+    run("bytestuffer wr3", []() {
+        return stuffer_volume(3, [](ByteStuffer& out, uint32_t x) { out.wr3(x); });
+    });
+    run("bytestuffer wr 16B", []() {
+        static constexpr uint8_t kBlob[16] = "0123456789abcde";
+        return stuffer_volume(16, [](ByteStuffer& out, uint32_t) { out.wr(kBlob); });
+    });
+    run("bitstuffer wr 9b", []() { return bitstuffer_volume(9); });
+
+#if defined(HAVE_ZLIB) || defined(HAVE_LIBDEFLATE)
+    if (wanted("zlib") || wanted("libdeflate")) {
+        // Compression only; add "catfacts raw" for the total.
+        auto text = raw_catfacts();
+#if defined(HAVE_ZLIB)
+        run("zlib -1 (raw output)", [&]() { return zlib_volume(text, 1); });
+#endif
+#if defined(HAVE_LIBDEFLATE)
+        run("libdeflate -1 (raw output)", [&]() { return libdeflate_volume(text, 1); });
+#endif
+    }
+#endif
+
+    if (wanted("ffwd")) bench_ffwd(1000);
+    return 0;
+}
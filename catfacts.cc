@@ -1,4 +1,7 @@
 #include "catfacts.h"
+#if defined(DEFL8BIT_COMPILED)
+#include "compiled.h"
+#endif
 
 template <typename T>
 static constexpr ML::GenBuilder<T> cat_facts() {
@@ -14,39 +17,36 @@ static constexpr ML::GenBuilder<T> cat_facts() {
         "1001 Facts About Cats"
     );
     auto regional = ml.pick(
-        "American",
+        ML::weight(4, "American"),
         "Canadian",
         "International",
         "Interstellar",
         "Intergalactic",
-        "Internal",
-        "American",
-        "American",
-        "American"
+        "Internal"
     );
-    auto organisation = ml.pick(
+    auto organisation = ml.cached(ml.pick(
         ml("The ",regional," Cat Club"),
         ml("The ",regional," Cat Enthusiasts' Club"),
         ml("The ",regional," Cat Euthanists' Club")
-    );
-    auto credential = ml.pick(
+    ));
+    auto credential = ml.cached(ml.pick(
         ml(", author of ",book_title),
         ml(", founder of ",organisation)
-    );
-    auto front_authority = ml.pick(
+    ));
+    auto front_authority = ml.cached(ml.pick(
         ml("According to ",authority_person,", "),
         ml(authority_person,credential," says, ")
-    );
+    ));
     auto attests = ml.pick(
         ", according to ",
         ", says ",
         ", writes "
     );
-    auto back_authority = ml.pick(
+    auto back_authority = ml.cached(ml.pick(
         "",
         ml(attests, authority_person),
         ml(attests, authority_person, credential)
-    );
+    ));
     auto preamble = ml.pick(
         "Did you know, ",
         "Fun fact: ",
@@ -76,9 +76,7 @@ static constexpr ML::GenBuilder<T> cat_facts() {
         "president"
     );
     auto comment = ml.pick(
-        "",
-        "",
-        "",
+        ML::weight(3, ""),
         "  Wowee!",
         "  Mee-ow!",
         "  Luckily no domestic cat has ever achieved this.",
@@ -351,9 +349,32 @@ static constexpr ML::GenBuilder<T> cat_facts() {
     return ml;
 }
 
-constexpr auto gzip_tmp = cat_facts<GZip>();
 constexpr auto raw_tmp = cat_facts<RawData>();
+constexpr Defl8bitTables catfacts_tables{Defl8bitFittedLengths<raw_tmp.histogram()>{}};
+
+constexpr auto gzip_tmp = cat_facts<CatFactsGZip>();
+constexpr auto generic_gzip_tmp = cat_facts<GZip>();
+constexpr auto gzip4_tmp = cat_facts<GZip4>();
+constexpr auto zlib_tmp = cat_facts<ZLib>();
+constexpr auto size_tmp = cat_facts<CatFactsSize>();
 constexpr auto gzip_catfacts = gzip_tmp.make_pack<gzip_tmp.sizes()>();
 constexpr auto raw_catfacts = raw_tmp.make_pack<raw_tmp.sizes()>();
+constexpr auto gzip4_catfacts = gzip4_tmp.make_pack<gzip4_tmp.sizes()>();
+constexpr auto generic_gzip_catfacts = generic_gzip_tmp.make_pack<generic_gzip_tmp.sizes()>();
+constexpr auto zlib_catfacts = zlib_tmp.make_pack<zlib_tmp.sizes()>();
+constexpr auto size_catfacts = size_tmp.make_pack<size_tmp.sizes()>();
+
+constexpr CatFacts catfacts{gzip_catfacts, raw_catfacts, gzip4_catfacts, generic_gzip_catfacts,
+                            zlib_catfacts, size_catfacts};
 
-constexpr CatFacts catfacts{gzip_catfacts, raw_catfacts};
+#if defined(DEFL8BIT_COMPILED)
+void CatFacts::do_something_compiled(CatFactsGZip& out) const {
+    ML::Compiled<CatFactsGZip, gzip_catfacts>::decode(out);
+}
+void CatFacts::do_something_compiled(RawData& out) const {
+    ML::Compiled<RawData, raw_catfacts>::decode(out);
+}
+void CatFacts::do_something_compiled(GZip4& out) const {
+    ML::Compiled<GZip4, gzip4_catfacts>::decode(out);
+}
+#endif
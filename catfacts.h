@@ -1,20 +1,58 @@
 #if !defined(CATFACTS_H_INCLUDED)
 #define CATFACTS_H_INCLUDED
 
+#include <cstdio>
+
 #include "ml.h"
 #include "defl8bit.h"
 #include "checksum.h"
 
+// Huffman tables fitted to the cat facts grammar's text, and gzip with
+// them, which can only encode this grammar.
+extern const Defl8bitTables catfacts_tables;
+using CatFactsGZip = GZipWith<catfacts_tables>;
+// The size CatFactsGZip would come to, without generating it.
+using CatFactsSize = SizeOnlyWith<catfacts_tables>;
+
 struct CatFacts {
-    void do_something(GZip& out) const {
+    void do_something(CatFactsGZip& out) const {
         return gzip_catfacts_.decode(out);
     }
     void do_something(RawData& out) const {
         return raw_catfacts_.decode(out);
     }
+    void do_something(GZip4& out) const {
+        return gzip4_catfacts_.decode(out);
+    }
+    // With the general-purpose tables.
+    void do_something(GZip& out) const {
+        return generic_gzip_catfacts_.decode(out);
+    }
+    void do_something(ZLib& out) const {
+        return zlib_catfacts_.decode(out);
+    }
+    void do_something(CatFactsSize& out) const {
+        return size_catfacts_.decode(out);
+    }
+#if defined(DEFL8BIT_COMPILED)
+    // The same output, from the grammar compiled to native code (see
+    // compiled.h).  Opt-in, as it makes catfacts.cc several times slower
+    // to build.
+    void do_something_compiled(CatFactsGZip& out) const;
+    void do_something_compiled(RawData& out) const;
+    void do_something_compiled(GZip4& out) const;
+#endif
+    // Only meaningful when built with DEFL8BIT_PROFILE.
+    void report(FILE* out) const {
+        raw_catfacts_.report(out);
+    }
 
-    const ML::Generator<GZip> gzip_catfacts_;
+    const ML::Generator<CatFactsGZip> gzip_catfacts_;
     const ML::Generator<RawData> raw_catfacts_;
+    const ML::Generator<GZip4> gzip4_catfacts_;
+    const ML::Generator<GZip> generic_gzip_catfacts_;
+    const ML::Generator<ZLib> zlib_catfacts_;
+    const ML::Generator<CatFactsSize> size_catfacts_;
 };
 extern const CatFacts catfacts;
 
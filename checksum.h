@@ -1,6 +1,11 @@
 #if !defined(CHECKSUM_H_INCLUDED)
 #define CHECKSUM_H_INCLUDED
 
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+
 #if defined(__ARM_FEATURE_CRYPTO)
 #include <arm_neon.h>
 #elif defined(__amd64__) && defined(__PCLMUL__)
@@ -12,6 +17,10 @@
 #include <arm_acle.h>
 #endif
 
+#if defined(__amd64__) && defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 namespace {
 namespace CRCTools {
 static constexpr struct CRCTables {
@@ -155,8 +164,47 @@ static constexpr uint32_t crc(uint32_t crc, uint64_t x = 0) {
 #endif
 }
 
+// Up to eight bytes of p as one little-endian word.
+static constexpr uint64_t load(uint8_t const* p, size_t n) {
+    uint64_t x = 0;
+    for (size_t i = 0; i < n; ++i) x |= uint64_t(p[i]) << (i * 8);
+    return x;
+}
+
+// Multiply crc by a factor from the ffwd tables.
+static constexpr uint32_t ffwd_mul(uint32_t crc, uint32_t factor) {
+    return CRCTools::crc<64>(0, clmul(crc, factor));
+}
+
+// ffwd_[n] only covers short runs.  Longer ones are split into base-256
+// digits, with one factor per non-zero digit taken from these tables.
+static constexpr struct FfwdPowTables {
+    constexpr FfwdPowTables() {
+        uint32_t base = tables.ffwd_[256];
+        for (int d = 0; d < kDigits; ++d) {
+            uint32_t seq = tables.ffwd_[0];
+            for (int i = 0; i < 256; ++i) {
+                pow_[d][i] = seq;
+                seq = ffwd_mul(seq, base);
+            }
+            base = seq;
+        }
+    }
+
+    static constexpr int kDigits = 3;
+    uint32_t pow_[kDigits][256];  // pow_[d][i] fast-forwards i << (8 * d + 8)
+} pow_tables;
+
 uint32_t ffwd(uint32_t crc, uint32_t n) {
-    return CRCTools::crc<64>(0, clmul(crc, tables.ffwd_[n]));
+    if (n < tables.kFfwdTableSize) [[likely]] {
+        return ffwd_mul(crc, tables.ffwd_[n]);
+    }
+    crc = ffwd_mul(crc, tables.ffwd_[n & 255]);
+    n >>= 8;
+    for (int d = 0; n != 0; ++d, n >>= 8) {
+        if (n & 255) crc = ffwd_mul(crc, pow_tables.pow_[d][n & 255]);
+    }
+    return crc;
 }
 
 }  // namespace CRCTools
@@ -164,11 +212,13 @@ uint32_t ffwd(uint32_t crc, uint32_t n) {
 
 struct NullChecksum {
     constexpr NullChecksum() {}
-    // constexpr NullChecksum(uint32_t) {}
+    constexpr NullChecksum(uint32_t) {}
 
     constexpr uint8_t add(uint8_t byte) { return byte; }
+    constexpr void add(std::span<const uint8_t>) {}
     constexpr void ffwd(size_t distance) {}
     constexpr void splice(uint32_t sum) {}
+    constexpr void append(uint32_t sum, uint64_t length) {}
 
     constexpr void sync() {}
 
@@ -193,6 +243,29 @@ struct Adler32 : private NullChecksum {
         return byte;
     }
 
+    // A run of bytes, in blocks of 16: each byte adds to b once for
+    // itself and once more for every byte after it in the block.
+    constexpr void add(std::span<const uint8_t> s) {
+        while (s.size() >= 16) {
+            size_t n = s.size() & ~size_t(15);
+            if (n > 4096) n = 4096;  // so the block sums can't overflow
+            uint32_t a = 0, b = 0;
+            if (std::is_constant_evaluated() || !add_blocks(s.first(n), a, b)) {
+                for (size_t i = 0; i < n; i += 16) {
+                    b += a * 16;
+                    for (int j = 0; j < 16; ++j) {
+                        a += s[i + j];
+                        b += (16 - j) * s[i + j];
+                    }
+                }
+            }
+            bsum_ = (bsum_ + asum_ * n + b) % 65521;
+            asum_ = (asum_ + a) % 65521;
+            s = s.subspan(n);
+        }
+        for (uint8_t byte : s) add(byte);
+    }
+
     constexpr void ffwd(size_t distance) {
         bsum_ += asum_ * distance;
         sync();
@@ -206,8 +279,16 @@ struct Adler32 : private NullChecksum {
         sync();
     }
 
+    // Like ffwd() and splice(), for a run of any length whose checksum was
+    // computed from a zero initial state.
+    constexpr void append(uint32_t sum, uint64_t length) {
+        asum_ %= 65521;
+        bsum_ += asum_ * (length % 65521);
+        splice(sum);
+    }
+
     constexpr void sync() {
-        asum_ %= 65531;
+        asum_ %= 65521;
         bsum_ %= 65521;
     }
 
@@ -217,9 +298,45 @@ struct Adler32 : private NullChecksum {
     }
     constexpr operator uint32_t() const { return get(); }
 
+   private:
+    // add()'s blocks, starting from zero sums, sixteen bytes to an
+    // instruction where there's SSSE3: a from SAD against zero, b from
+    // multiplying by the weights 16..1.  False if there's no vector path.
+    static bool add_blocks(std::span<const uint8_t> s, uint32_t& a, uint32_t& b) {
+#if defined(__amd64__) && defined(__SSSE3__)
+        const __m128i weights = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+        const __m128i ones = _mm_set1_epi16(1);
+        __m128i va = _mm_setzero_si128();  // a, in two 64-bit lanes
+        __m128i vs = _mm_setzero_si128();  // a before each block, summed
+        __m128i vb = _mm_setzero_si128();
+        for (size_t i = 0; i < s.size(); i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&s[i]));
+            vs = _mm_add_epi32(vs, va);
+            va = _mm_add_epi32(va, _mm_sad_epu8(v, _mm_setzero_si128()));
+            vb = _mm_add_epi32(vb, _mm_madd_epi16(_mm_maddubs_epi16(v, weights), ones));
+        }
+        auto sum = [](__m128i v) {
+            v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4e));
+            v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xb1));
+            return uint32_t(_mm_cvtsi128_si32(v));
+        };
+        a = sum(va);
+        b = sum(vb) + sum(vs) * 16;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+   public:
+
     static constexpr uint32_t check(uint32_t init, auto&& s) {
         Adler32 check{init};
-        for (auto c : s) check.add(c);
+        if constexpr (std::is_convertible_v<decltype(s), std::span<const uint8_t>>) {
+            check.add(std::span<const uint8_t>(s));
+        } else {
+            for (auto c : s) check.add(c);
+        }
         return check;
     }
 };
@@ -234,6 +351,21 @@ struct CRC32 : private NullChecksum {
         return byte;
     }
 
+    // A run of bytes, eight at a time.  The last few go in one step too,
+    // at the end of a word which starts with zeros: with the register's
+    // contents moved along to meet them, the zeros leave it unchanged.
+    constexpr void add(std::span<const uint8_t> s) {
+        size_t i = 0;
+        for (; i + 8 <= s.size(); i += 8) {
+            crc_ = CRCTools::crc<64>(crc_, CRCTools::load(&s[i], 8));
+        }
+        if (size_t n = s.size() - i) {
+            uint64_t x = CRCTools::load(&s[i], n) ^ crc_;
+            uint32_t carry = n < 4 ? crc_ >> (n * 8) : 0;
+            crc_ = CRCTools::crc<64>(0, x << (64 - n * 8)) ^ carry;
+        }
+    }
+
     constexpr void ffwd(size_t distance) {
         crc_ = CRCTools::ffwd(crc_, distance);
     }
@@ -242,6 +374,15 @@ struct CRC32 : private NullChecksum {
         crc_ ^= crc;
     }
 
+    // Like ffwd() and splice(), for a run of any length whose checksum was
+    // computed from a zero initial state.
+    void append(uint32_t crc, uint64_t length) {
+        for (; length > UINT32_MAX; length -= UINT32_MAX) {
+            crc_ = CRCTools::ffwd(crc_, UINT32_MAX);
+        }
+        crc_ = CRCTools::ffwd(crc_, length) ^ crc;
+    }
+
     constexpr void sync() {}
 
     constexpr uint32_t get(bool finalise = false) const {
@@ -252,7 +393,11 @@ struct CRC32 : private NullChecksum {
 
     static constexpr uint32_t check(uint32_t init, auto&& s) {
         CRC32 check{init};
-        for (auto c : s) check.add(c);
+        if constexpr (std::is_convertible_v<decltype(s), std::span<const uint8_t>>) {
+            check.add(std::span<const uint8_t>(s));
+        } else {
+            for (auto c : s) check.add(c);
+        }
         return check;
     }
 };
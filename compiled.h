@@ -0,0 +1,101 @@
+#if !defined(COMPILED_H_INCLUDED)
+#define COMPILED_H_INCLUDED
+
+#include <cstdint>
+#include <utility>
+
+#include "ml.h"
+
+namespace ML {
+
+// An alternative to Generator<T> for packs which are constexpr objects with
+// static storage: each command address becomes its own function, so the
+// compiler sees every production as straight-line code.  Literals are
+// immediate constants (lengths and checksums included), sequences inline
+// into their callers, and a pick is an indirect jump through a table of
+// its entries.
+//
+// Output is identical to Generator<T> on the same pack: calls past
+// Generator<T>::kMaxDepth are skipped in the same way, which also bounds
+// the native stack.  Build time grows with the size of the grammar, so
+// keep the interpreter for big ones.
+template <typename T, auto const& Pack>
+struct Compiled {
+    static void decode(T& out) {
+        run<Pack.entry.address>(out, 0);
+    }
+
+   private:
+    using MLOp = detail::MLOp;
+
+    template <uint32_t I>
+    static constexpr MLOp kCommand = Pack.commands[I];
+
+    template <uint32_t L>
+    static constexpr EncoderLiteral kBlob{Pack.headers[L], Pack.storage, L};
+
+    static constexpr int kMaxDepth = Generator<T>::kMaxDepth;
+
+    // Runs the production from address I until it ends, `depth` calls
+    // deep.
+    template <uint32_t I>
+    static void run(T& out, int depth) {
+        constexpr MLOp c = kCommand<I>;
+        constexpr uint32_t arg = c.arg();
+        if constexpr (c.op() == detail::kCall.op()) {
+            if (depth < kMaxDepth) [[likely]] run<arg>(out, depth + 1);
+            run<I + 1>(out, depth);
+        } else if constexpr (c.op() == detail::kJump.op()) {
+            run<arg>(out, depth);
+        } else if constexpr (c.op() == detail::kReturn.op()) {
+            return;
+        } else if constexpr (c.op() == detail::kLiteral.op()) {
+            out.blob(kBlob<arg>);
+            run<I + 1>(out, depth);
+        } else if constexpr (c.op() == detail::kLiteralReturn.op()) {
+            out.blob(kBlob<arg>);
+        } else if constexpr (c.op() == detail::kArray.op()
+                             || c.op() == detail::kLiteralArray.op()) {
+            pick<I + 1>(out, depth, out.randint(arg, 0), std::make_index_sequence<arg>{});
+        } else if constexpr (c.op() == detail::kAlias.op()) {
+            uint32_t r = out.randint(arg << 16, 0);
+            uint32_t k = Generator<T>::alias_pick(std::span(Pack.commands).subspan(I + 1, arg), r);
+            pick<I + 1 + arg>(out, depth, k, std::make_index_sequence<arg>{});
+        } else if constexpr (c.op() == detail::kRandInt.op()) {
+            out.integer(out.randint(kCommand<I + 1>.word_, arg));
+            run<I + 2>(out, depth);
+        } else if constexpr (c.op() == detail::kLiteralPick.op()) {
+            static_assert(arg > 0);
+            pick_blob<I + 1>(out, out.randint(arg, 0), std::make_index_sequence<arg>{});
+            run<I + 1 + arg>(out, depth);
+        } else if constexpr (c.op() == detail::kSubtree.op()) {
+            // As laid out by GenBuilder::cached().
+            static_assert(kCommand<I + 1>.op() == detail::kCall.op()
+                          && kCommand<I + 2>.op() == detail::kSubtreeEnd.op());
+            auto mark = out.subtree_begin();
+            if (depth < kMaxDepth) [[likely]] run<kCommand<I + 1>.arg()>(out, depth + 1);
+            out.subtree_end(mark, arg);
+        } else if constexpr (c.op() == detail::kProbability.op()) {
+            if (arg < out.randint(0x10000)) return;
+            run<I + 1>(out, depth);
+        } else {
+            static_assert(c.op() != c.op(), "unsupported opcode");
+        }
+    }
+
+    template <uint32_t I, size_t... K>
+    static void pick(T& out, int depth, uint32_t r, std::index_sequence<K...>) {
+        static constexpr void (*kEntries[])(T&, int) = { &run<I + K>... };
+        kEntries[r](out, depth);
+    }
+
+    template <uint32_t I, size_t... K>
+    static void pick_blob(T& out, uint32_t r, std::index_sequence<K...>) {
+        static constexpr EncoderLiteral kEntries[] = { kBlob<kCommand<I + K>.arg()>... };
+        out.blob(kEntries[r]);
+    }
+};
+
+}  // namespace ML
+
+#endif  // !defined(COMPILED_H_INCLUDED)
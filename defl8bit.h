@@ -11,9 +11,11 @@
 #include "stuffer.h"
 #include "checksum.h"
 #include "huffman.h"
+#include "profile.h"
+#include "prng.h"
 
 struct EncoderLiteral {
-    using LPIndex = uint16_t;
+    using LPIndex = uint32_t;
     template <typename T>
     constexpr EncoderLiteral(T const& lit, std::span<const uint8_t> storage, int index)
         : literal(storage.subspan(lit.literal_offset, lit.literal_length)),
@@ -27,13 +29,18 @@ struct EncoderLiteral {
     LPIndex i;
 };
 
-template <typename T_cksum = NullChecksum>
+template <typename T_cksum = NullChecksum, typename T_stuffer = ByteStuffer>
 struct EncoderBase {
     EncoderBase() {}
     EncoderBase(std::span<uint8_t> out) : out_(out) {}
     void reset() { out_.clear(); }
-    void reset(std::span<uint8_t> dest) { out_ = dest; }
-    void seed(uint64_t seed) { prng_ = seed; }
+    // history is how many bytes of earlier output are intact just before
+    // dest, for backref() to copy from (see OutputSink).
+    void reset(std::span<uint8_t> dest, size_t history = 0) {
+        out_.rebind(dest);
+        history_ = history;
+    }
+    void seed(uint64_t seed) { prng_.seed(seed); }
     uint8_t* begin() const { return out_.begin(); }
     uint8_t* end() const { return out_.end(); }
     size_t size() const { return out_.size(); }
@@ -50,17 +57,69 @@ struct EncoderBase {
     }
 
     uint32_t randint(uint32_t range, uint32_t start = 0) {
-       uint64_t z = prng_;
-       prng_ += UINT64_C(0x9e3779b97f4a7c15);
-       z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
-       z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
-       return (((z >> 32) * range) >> 32) + start;
+       uint64_t z = prng_.next();
+       uint32_t r = (((z >> 32) * range) >> 32) + start;
+       if (open_subtrees_ > 0) choices_ = (choices_ + r) * UINT64_C(0xff51afd7ed558ccd);
+       return r;
+    }
+
+    // Subtree cache hooks (see ML::GenBuilder::cached()); an encoder
+    // without one just expands every subtree.
+    struct SubtreeMark {};
+    constexpr SubtreeMark subtree_begin() { return {}; }
+    constexpr void subtree_end(SubtreeMark const&, uint32_t) {}
+
+    // Send anything held back (see Defl8bit's pending match).  tail() does
+    // this; a stream ended some other way must call it.
+    constexpr void flush() {}
+
+    // Start over as a segment to be joined onto some other stream with
+    // append_segment(): position and checksum relative to zero.
+    void start_segment() {
+        position_ = 0;
+        checksum_ = T_cksum(0);
+    }
+
+    // Account for a segment emitted by another encoder, as if it had been
+    // generated here.
+    void append_segment(uint32_t length, uint32_t checksum) {
+        position_ += length;
+        checksum_.append(checksum, length);
+    }
+
+    // Enough of the state between entries to carry on from there as if
+    // everything before had been generated (see SeekIndex).  text and size
+    // are the caller's running totals of text and output, kept alongside.
+    struct Checkpoint {
+        uint64_t text = 0;
+        uint64_t size = 0;
+        uint64_t prng = 0;
+        uint64_t choices = 0;
+        uint32_t position = 0;
+        uint32_t checksum = 0;
+    };
+
+    Checkpoint checkpoint(uint64_t text, uint64_t size) const {
+        return {text, size, prng_.state(), choices_, position_, checksum_.get()};
+    }
+
+    void resume(Checkpoint const& c) {
+        prng_.seed(c.prng);
+        choices_ = c.choices;
+        position_ = c.position;
+        checksum_ = T_cksum(c.checksum);
     }
 
     // Should probably be virtual:
     constexpr void backref(uint16_t length, uint16_t distance) {
-        if (distance < out_.size()) {
-            out_.wr(std::span(out_.end() - distance, out_.end()));
+        if (distance > 0 && distance <= out_.size() + history_) {
+            uint8_t const* from = out_.end() - distance;
+            if (length <= distance) {
+                out_.wr(std::span(from, length));
+            } else {
+                // Overlaps itself, repeating the last `distance` bytes.
+                for (int i = 0; i < length; ++i) out_.wr1(from[i]);
+            }
         } else {
             constexpr uint8_t oops[] = "###out of bounds backref###";
             out_.wr(oops);
@@ -97,49 +156,78 @@ struct EncoderBase {
             value /= 10;
             *--p = 0x30 + d;
         } while (value > 0);
-        position_ += end - p;
         for (auto digit : std::span(p, end)) byte(digit);
     }
 
    protected:
+    // The checksum of literal text from a zero initial state, as a blob
+    // splices it in; a whole run at a time outside constant evaluation,
+    // which is where runtime-loaded grammars get theirs.
+    static constexpr T_cksum literal_checksum(std::string_view s) {
+        T_cksum check(0);
+        if (std::is_constant_evaluated()) {
+            for (uint8_t byte : s) check.add(byte);
+        } else {
+            check.add(std::span(reinterpret_cast<uint8_t const*>(s.data()), s.size()));
+        }
+        return check;
+    }
+
     struct {
         void assign(size_t, uint32_t) {}
     } last_use_;
-    ByteStuffer out_;
+    T_stuffer out_;
+    size_t history_ = 0;
     uint32_t position_ = 0;
-    uint64_t prng_ = 1;
+    EncoderPrng prng_;
+    uint64_t choices_ = 0;  // hash of randint() results within subtrees
+    uint32_t open_subtrees_ = 0;  // only a subtree cache opens any
     T_cksum checksum_;
 };
 
 using RawData = EncoderBase<NullChecksum>;
 
-template <typename T_cksum = Adler32>
-class Defl8bit : public EncoderBase<T_cksum> {
-    using super = EncoderBase<T_cksum>;
+// Tables is hufftable by default, or one fitted to a particular grammar
+// (see Defl8bitFittedLengths), in which case only that grammar's literals
+// can be encoded.  T_stuffer is ByteStuffer but for sizing (SizeOnlyWith).
+template <typename T_cksum = Adler32, Defl8bitTables const& Tables = hufftable,
+          typename T_stuffer = ByteStuffer>
+class Defl8bit : public EncoderBase<T_cksum, T_stuffer> {
+    using super = EncoderBase<T_cksum, T_stuffer>;
+
+    // See subtree_end().
+    static constexpr size_t kSubtreeWays = 16;
+    struct SubtreeEntry {
+        uint64_t key = 0;
+        uint32_t position = 0;
+        uint32_t length = 0;
+    };
 
    public:
     static constexpr uint32_t kIllegalOffset = UINT32_MAX /*- 65536*/;
+    using super::literal_checksum;
     std::tuple<uint32_t, uint32_t> tell() const {
         return {position_, checksum_.get()};
     }
 
     constexpr void block_head() {
-        out_.wr(hufftable.header_blob_);
+        out_.wr(Tables.header());
     }
 
     constexpr void block_tail() {
-        assert(hufftable.litcodelen_[256] == 8);
-        out_.wr1(uint8_t(hufftable.litcode_[256]));
+        flush();
+        assert(Tables.litcodelen_[256] == 8);
+        out_.wr1(uint8_t(Tables.litcode_[256]));
     }
 
     static constexpr uint32_t encode_literal(auto& out, std::string_view s) {
-        T_cksum check(0);
+        T_cksum check = literal_checksum(s);
         int utf_shift = 0;
         uint64_t utf_chunk = 0;
         for (uint8_t byte : s) {
-            int code = hufftable.litcode_[byte];
-            int code_len = hufftable.litcodelen_[byte];
-            check.add(byte);
+            int code = Tables.litcode_[byte];
+            int code_len = Tables.litcodelen_[byte];
+            assert(code_len > 0);
             if (byte < 0x80) {
                 assert(code_len == 8);
                 out.push_back(code);
@@ -156,8 +244,8 @@ class Defl8bit : public EncoderBase<T_cksum> {
                 }
             } else if (byte < 0xf8) {
                 // Can avoid setting a lengh counter, here, because we
-                // stop on a multiple of 8 bits and never visit another
-                // multiple on the way:
+                // stop on a multiple of 8 bits (and flushing at any
+                // multiple on the way is harmless).  With hufftable:
                 //  - 0xc0-0xdf: code lengths: 14, 24
                 //  - 0xe0-0xef: code lengths: 12, 22, 32
                 //  - 0xf0-0xf7: code lengths: 10, 20, 30, 40
@@ -169,6 +257,8 @@ class Defl8bit : public EncoderBase<T_cksum> {
     }
 
     constexpr void backref(uint16_t length, uint16_t distance) {
+        int bytes = Tables.tuple_bytes(distance);
+        uint32_t distance_bits = Tables.distance_bits(distance);
         while (length >= 3) {
             int run = length;
             if (run > 258) {
@@ -177,8 +267,8 @@ class Defl8bit : public EncoderBase<T_cksum> {
                 if (length - run == 2) run--;
             }
 
-            uint32_t bits = hufftable.match_table_[run] | (uint32_t(hufftable.dist_table_[distance]) << 9);
-            out_.wr3(bits);
+            uint32_t bits = Tables.match_table_[run] | (distance_bits << 9);
+            out_.wrn(bits, bytes);
             length -= run;
         }
         // checksum & length are caller's responsibility
@@ -186,10 +276,389 @@ class Defl8bit : public EncoderBase<T_cksum> {
 
     // Should probably be virtual:
     constexpr void literal(std::span<const uint8_t> s) {
+        flush();
         out_.wr(s);
         // checksum & length are caller's responsibility
     }
 
+    // A hit isn't sent straight away: while the blobs after it hit at the
+    // same distance, they were adjacent last time too, and just lengthen
+    // the one match.  It's sent once anything else comes along.
+    constexpr void flush() {
+        if (pending_length_ > 0) {
+            backref(pending_length_, pending_distance_);
+            pending_length_ = 0;
+        }
+    }
+
+    constexpr void blob(EncoderLiteral blob) {
+        int i = blob.i;
+        if (i >= last_use_.size()) {
+            last_use_.resize(i + 16, kIllegalOffset);
+        }
+        uint32_t last_use = last_use_[i];
+        last_use_[i] = position_;
+        uint32_t distance = position_ - last_use;
+        if (pending_length_ > 0 && last_use != kIllegalOffset && distance == pending_distance_) {
+            Profile::blob(i, blob.length, true, distance);
+            Profile::coalesce();
+            pending_length_ += blob.length;
+            // Send whole 258-byte runs as they fill, keeping at least 3
+            // back so the rest is still a match.
+            while (pending_length_ > 258 + 2) {
+                backref(258, distance);
+                pending_length_ -= 258;
+            }
+        } else {
+            // Whichever is shorter, the backref or the literal itself.
+            bool hit = blob.length >= 3 && last_use != kIllegalOffset && distance <= 32768
+                       && blob.literal.size() >= size_t(Tables.tuple_bytes(distance));
+            Profile::blob(i, blob.length, hit, distance);
+
+            if (hit) {
+                flush();
+                pending_length_ = blob.length;
+                pending_distance_ = distance;
+            } else {
+                literal(blob.literal);
+            }
+        }
+        position_ += blob.length;
+        checksum_.ffwd(blob.length);
+        checksum_.splice(blob.checksum);
+    }
+
+    constexpr void byte(uint8_t byte) {
+        flush();
+        assert(Tables.litcodelen_[byte] == 8);
+        out_.wr1(Tables.litcode_[byte]);
+        checksum_.add(byte);
+        position_++;
+    }
+
+    // The digits' checksum in one step, then their codes, which are all
+    // one byte long, in place.
+    constexpr void integer(uint32_t value) {
+        uint8_t tmp[16], *const end = tmp + 16, *p = end;
+        do {
+            int d = value % 10;
+            value /= 10;
+            *--p = 0x30 + d;
+        } while (value > 0);
+        auto digits = std::span(p, end);
+        checksum_.add(digits);
+        position_ += digits.size();
+        for (uint8_t& digit : digits) {
+            assert(Tables.litcodelen_[digit] == 8);
+            digit = Tables.litcode_[digit];
+        }
+        literal(digits);
+    }
+
+    // The base state plus whatever the window can still reach: the blobs
+    // and subtree expansions used within the last 32K, and any match not
+    // yet sent.  Everything older could never be a hit again, so resume()
+    // leaves it out.
+    struct Checkpoint : super::Checkpoint {
+        std::vector<std::pair<uint32_t, uint32_t>> last_use;  // index, position
+        std::vector<std::pair<uint32_t, SubtreeEntry>> subtrees;  // cache index
+        uint32_t pending_length = 0;
+        uint32_t pending_distance = 0;
+    };
+
+    Checkpoint checkpoint(uint64_t text, uint64_t size) const {
+        Checkpoint c{super::checkpoint(text, size)};
+        for (uint32_t i = 0; i < last_use_.size(); ++i) {
+            if (last_use_[i] != kIllegalOffset && position_ - last_use_[i] <= 32768) {
+                c.last_use.emplace_back(i, last_use_[i]);
+            }
+        }
+        for (uint32_t i = 0; i < subtree_cache_.size(); ++i) {
+            auto const& entry = subtree_cache_[i];
+            if (entry.key != 0 && position_ - entry.position <= 32768) {
+                c.subtrees.emplace_back(i, entry);
+            }
+        }
+        c.pending_length = pending_length_;
+        c.pending_distance = pending_distance_;
+        return c;
+    }
+
+    void resume(Checkpoint const& c) {
+        super::resume(c);
+        last_use_.assign(c.last_use.empty() ? 0 : c.last_use.back().first + 16, kIllegalOffset);
+        for (auto [i, position] : c.last_use) last_use_[i] = position;
+        subtree_cache_.clear();
+        for (auto const& [i, entry] : c.subtrees) {
+            if (i >= subtree_cache_.size()) {
+                subtree_cache_.resize((i / kSubtreeWays + 1) * kSubtreeWays);
+            }
+            subtree_cache_[i] = entry;
+        }
+        pending_length_ = c.pending_length;
+        pending_distance_ = c.pending_distance;
+    }
+
+    // The subtree cache has kSubtreeWays entries per slot, direct-mapped
+    // by the hash of the choices made in an expansion: each holds the
+    // last expansion whose hash picked it, so two recent ones which pick
+    // the same entry evict each other.  An expansion which matches its
+    // entry within the window, with the same length, is rewound and sent
+    // as a backref instead, if that's shorter; the text (and so every
+    // position in last_use_, and the checksum) is unchanged.
+    struct SubtreeMark {
+        size_t size;
+        uint32_t position;
+        uint64_t choices;
+    };
+
+    constexpr SubtreeMark subtree_begin() {
+        flush();
+        SubtreeMark mark{out_.size(), position_, choices_};
+        choices_ = 0;
+        open_subtrees_++;
+        return mark;
+    }
+
+    constexpr void subtree_end(SubtreeMark const& mark, uint32_t slot) {
+        flush();
+        open_subtrees_--;
+        uint64_t key = choices_ + 1;
+        choices_ = (mark.choices + key) * UINT64_C(0xff51afd7ed558ccd);
+
+        size_t i = slot * kSubtreeWays + (key >> 32) % kSubtreeWays;
+        if (i >= subtree_cache_.size()) {
+            subtree_cache_.resize((slot + 1) * kSubtreeWays);
+        }
+        auto& entry = subtree_cache_[i];
+        uint32_t length = position_ - mark.position;
+        uint32_t distance = mark.position - entry.position;
+        bool hit = entry.key == key && entry.length == length && length >= 3 && distance <= 32768;
+        size_t sent = out_.size() - mark.size;
+        size_t backref_size = (length + 257) / 258 * Tables.tuple_bytes(distance);
+        hit = hit && backref_size < sent;
+        Profile::subtree(hit, hit ? sent - backref_size : 0);
+        if (hit) {
+            out_.rewind(mark.size);
+            pending_length_ = length;
+            pending_distance_ = distance;
+        }
+        entry = {key, mark.position, length};
+    }
+
+   protected:
+    std::vector<uint32_t> last_use_;
+    std::vector<SubtreeEntry> subtree_cache_;
+    uint32_t pending_length_ = 0;  // of the match not yet sent; 0 for none
+    uint32_t pending_distance_ = 0;
+    using super::out_;
+    using super::position_;
+    using super::checksum_;
+    using super::choices_;
+    using super::open_subtrees_;
+};
+
+using GZipCksum = CRC32;
+template <Defl8bitTables const& Tables = hufftable>
+class GZipWith : public Defl8bit<GZipCksum, Tables> {
+    using super = Defl8bit<GZipCksum, Tables>;
+
+   public:
+    using super::integer;
+    using super::blob;
+    using super::randint;
+    GZipWith() {}
+    GZipWith(std::span<uint8_t> dest) { out_ = dest; }
+
+    void head(time_t time = 0) {
+        out_.wr1(0x1f);
+        out_.wr1(0x8b);
+        out_.wr1(0x08);
+        out_.wr1(0x01);  // text
+        out_.wr4(time);
+        out_.wr1(0);  // fast algorithm
+        out_.wr1(3);  // unix
+        this->block_head();
+    }
+
+    void tail() {
+        this->block_tail();
+        out_.wr4(checksum_.get(true));
+        out_.wr4(position_);
+    }
+
+   protected:
+    using super::last_use_;
+    using super::out_;
+    using super::position_;
+    using super::checksum_;
+};
+using GZip = GZipWith<>;
+
+// The same deflate stream in zlib framing (RFC 1950): two header bytes
+// and a big-endian Adler32, rather than gzip's ten and eight, which counts
+// on short responses.
+template <Defl8bitTables const& Tables = hufftable>
+class ZLibWith : public Defl8bit<Adler32, Tables> {
+    using super = Defl8bit<Adler32, Tables>;
+
+   public:
+    using super::integer;
+    using super::blob;
+    using super::randint;
+    ZLibWith() {}
+    ZLibWith(std::span<uint8_t> dest) { out_ = dest; }
+
+    // zlib has nowhere for the time; it's accepted to match GZip.
+    void head(time_t = 0) {
+        out_.wr1(0x78);  // deflate, 32K window
+        out_.wr1(0x01);  // fastest; check bits for 0x7801
+        this->block_head();
+    }
+
+    void tail() {
+        this->block_tail();
+        out_.wr4(__builtin_bswap32(checksum_.get(true)));
+    }
+
+   protected:
+    using super::out_;
+    using super::checksum_;
+};
+using ZLib = ZLibWith<>;
+
+// Goes through the motions of GZipWith<Tables> -- the same backrefs,
+// pending matches and subtree hits -- but only counts the bytes, and
+// keeps no checksum.  After the same seed and the same calls, size() and
+// tell()'s position are exactly what GZipWith's would be, which is enough
+// for a Content-Length ahead of the real thing.  The pack has to be built
+// for this type, but its literals are encoded as GZipWith's.
+template <Defl8bitTables const& Tables = hufftable>
+class SizeOnlyWith : public Defl8bit<NullChecksum, Tables, CountStuffer> {
+    using super = Defl8bit<NullChecksum, Tables, CountStuffer>;
+
+   public:
+    using super::integer;
+    using super::blob;
+    using super::randint;
+    SizeOnlyWith() {}
+    SizeOnlyWith(std::span<uint8_t>) {}
+
+    // As GZipWith's, byte for byte.
+    void head(time_t = 0) {
+        out_.wr4(0);  // magic, method, flags
+        out_.wr4(0);  // time
+        out_.wr2(0);  // extra flags, OS
+        this->block_head();
+    }
+
+    void tail() {
+        this->block_tail();
+        out_.wr4(0);  // CRC32
+        out_.wr4(0);  // length
+    }
+
+   protected:
+    using super::out_;
+};
+using SizeOnly = SizeOnlyWith<>;
+
+// As Defl8bit, but with the nibble-aligned code (Defl4bitLengths), which
+// spends a little more on long backrefs to spend much less on literal
+// text.
+template <typename T_cksum = Adler32>
+class Defl4bit : public EncoderBase<T_cksum, NibbleStuffer> {
+    using super = EncoderBase<T_cksum, NibbleStuffer>;
+
+   public:
+    static constexpr uint32_t kIllegalOffset = UINT32_MAX;
+    // Small RandInt ranges as picks over their numbers' literals (see
+    // ML::max_literal_pick()): faster than integer() here, and smaller.
+    static constexpr uint32_t kMaxLiteralPick = 256;
+    std::tuple<uint32_t, uint32_t> tell() const {
+        return {position_, checksum_.get()};
+    }
+
+    // The base checkpoint would lose last_use_ and the half-filled byte.
+    void resume(typename super::Checkpoint const&) = delete;
+
+    constexpr void block_head() {
+        out_.wr_aligned(nibbletable.header_blob_, nibbletable.header_nibbles_);
+    }
+
+    constexpr void block_tail() {
+        out_.wr_nibbles(nibbletable.litcodelen_[256] / 4, nibbletable.litcode_[256]);
+    }
+
+    // The literal's codes as a run of nibbles, stored twice over to suit
+    // NibbleStuffer::wr_literal(): once from a byte boundary and once from
+    // half a byte in.  That makes the storage one byte longer than the
+    // number of nibbles.
+    static constexpr uint32_t encode_literal(auto& out, std::string_view s) {
+        T_cksum check = super::literal_checksum(s);
+        std::vector<uint8_t> nibbles;
+        for (uint8_t byte : s) {
+            int code = nibbletable.litcode_[byte];
+            int code_len = nibbletable.litcodelen_[byte];
+            assert(code_len > 0 && code_len % 4 == 0);
+            for (int i = 0; i < code_len; i += 4) nibbles.push_back((code >> i) & 15);
+        }
+        size_t n = nibbles.size();
+        for (int phase = 0; phase < 2; ++phase) {
+            uint8_t byte = 0;
+            for (size_t i = 0; i < n + phase; ++i) {
+                uint8_t nibble = i < size_t(phase) ? 0 : nibbles[i - phase];
+                if (i & 1) {
+                    out.push_back(byte | nibble << 4);
+                    byte = 0;
+                } else {
+                    byte = nibble;
+                }
+            }
+            if ((n + phase) & 1) out.push_back(byte);
+        }
+        return check;
+    }
+
+    constexpr void backref(uint16_t length, uint16_t distance) {
+        while (length >= 3) {
+            int run = length;
+            if (run > 258) {
+                run = 258;
+                if (length - run == 1) run--;
+                if (length - run == 2) run--;
+            }
+
+            int bits = nibbletable.match_bits_[run];
+            uint64_t tuple = nibbletable.match_table_[run]
+                             | (uint64_t(nibbletable.dist_table_[distance]) << bits);
+            out_.wr_nibbles((bits + 15) / 4, tuple);
+            length -= run;
+        }
+        // checksum & length are caller's responsibility
+    }
+
+    // What backref() spends on `length`, in nibbles.
+    static constexpr size_t backref_nibbles(uint16_t length) {
+        size_t n = 0;
+        while (length >= 3) {
+            int run = length;
+            if (run > 258) {
+                run = 258;
+                if (length - run == 1) run--;
+                if (length - run == 2) run--;
+            }
+            n += (nibbletable.match_bits_[run] + 15) / 4;
+            length -= run;
+        }
+        return n;
+    }
+
+    constexpr void literal(std::span<const uint8_t> s) {
+        out_.wr_literal(s);
+        // checksum & length are caller's responsibility
+    }
+
     constexpr void blob(EncoderLiteral blob) {
         int i = blob.i;
         if (i >= last_use_.size()) {
@@ -198,7 +667,12 @@ class Defl8bit : public EncoderBase<T_cksum> {
         uint32_t last_use = last_use_[i];
         last_use_[i] = position_;
         uint32_t distance = position_ - last_use;
-        bool hit = blob.length >= 3 && last_use != kIllegalOffset && distance <= 32768;
+        // Only where the backref is shorter: a short literal of 4-bit
+        // codes can beat its 6 or 7 nibbles.  The stored literal is one
+        // byte longer than its nibble count (see encode_literal()).
+        bool hit = blob.length >= 3 && last_use != kIllegalOffset && distance <= 32768
+                   && backref_nibbles(blob.length) < blob.literal.size() - 1;
+        Profile::blob(i, blob.length, hit, distance);
 
         if (hit) {
             backref(blob.length, distance);
@@ -211,8 +685,7 @@ class Defl8bit : public EncoderBase<T_cksum> {
     }
 
     constexpr void byte(uint8_t byte) {
-        assert(hufftable.litcodelen_[byte] == 8);
-        out_.wr1(hufftable.litcode_[byte]);
+        out_.wr_nibbles(nibbletable.litcodelen_[byte] / 4, nibbletable.litcode_[byte]);
         checksum_.add(byte);
         position_++;
     }
@@ -224,7 +697,12 @@ class Defl8bit : public EncoderBase<T_cksum> {
             value /= 10;
             *--p = 0x30 + d;
         } while (value > 0);
-        for (auto digit : std::span(p, end)) byte(digit);
+        auto digits = std::span(p, end);
+        checksum_.add(digits);
+        position_ += digits.size();
+        for (uint8_t digit : digits) {
+            out_.wr_nibbles(nibbletable.litcodelen_[digit] / 4, nibbletable.litcode_[digit]);
+        }
     }
 
    protected:
@@ -234,16 +712,16 @@ class Defl8bit : public EncoderBase<T_cksum> {
     using super::checksum_;
 };
 
-using GZipCksum = CRC32;
-class GZip : public Defl8bit<GZipCksum> {
-    using super = Defl8bit<GZipCksum>;
+// A gzip stream using the nibble-aligned code.
+class GZip4 : public Defl4bit<GZipCksum> {
+    using super = Defl4bit<GZipCksum>;
 
    public:
     using super::integer;
     using super::blob;
     using super::randint;
-    GZip() {}
-    GZip(std::span<uint8_t> dest) { out_ = dest; }
+    GZip4() {}
+    GZip4(std::span<uint8_t> dest) { out_ = dest; }
 
     void head(time_t time = 0) {
         out_.wr1(0x1f);
@@ -258,6 +736,7 @@ class GZip : public Defl8bit<GZipCksum> {
 
     void tail() {
         block_tail();
+        out_.pad();
         out_.wr4(checksum_.get(true));
         out_.wr4(position_);
     }
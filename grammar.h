@@ -0,0 +1,405 @@
+#if !defined(GRAMMAR_H_INCLUDED)
+#define GRAMMAR_H_INCLUDED
+
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "ml.h"
+
+namespace ML {
+
+// A grammar loaded from text at runtime, laid out exactly as GenBuilder
+// would lay it out, so its Generator runs the same code at the same speed
+// as a compiled-in one.  The format:
+//
+//     # comment to end of line
+//     name = alternative | alternative ... ;
+//
+// where an alternative is a sequence of zero or more items, optionally
+// followed by `@weight`:
+//
+//     "text"      a literal, with \n, \t, \r, \", \\ and \xHH escapes
+//     name        another rule, which may be defined later
+//     {lo-hi}     a random integer from lo to hi inclusive
+//
+// A rule with one alternative is a sequence, and otherwise a pick (a
+// weighted one if any alternative has a weight).  The entry point is the
+// rule called `start`, or else the first rule.  Rules may recurse, but
+// past Generator<T>::kMaxDepth nested calls the deepest is cut short.
+//
+// Errors are reported on stderr, and are fatal.
+template <typename T>
+class Grammar {
+    using MLOp = detail::MLOp;
+    using LPIndex = detail::LPIndex;
+    using LiteralHeader = typename Generator<T>::LiteralHeader;
+
+   public:
+    static Grammar load(char const* path) {
+        FILE* f = fopen(path, "rb");
+        if (f == nullptr) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        std::string text;
+        char buffer[65536];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+            text.append(buffer, n);
+        }
+        if (ferror(f)) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        fclose(f);
+        return Grammar(text, path);
+    }
+
+    explicit Grammar(std::string_view text, char const* source = "<grammar>")
+            : source_(source), text_(text) {
+        parse();
+        emit();
+        // Drop the parse state; only the tables are needed from here on.
+        text_ = {};
+        rules_ = {};
+        rule_index_ = {};
+        literal_index_ = {};
+        numbers_ = {};
+        fixups_ = {};
+    }
+
+    // Only valid for as long as this Grammar lives, unmoved.
+    Generator<T> generator() const {
+        return Generator<T>(storage_, headers_, commands_, entry_);
+    }
+
+    size_t literals() const { return headers_.size(); }
+    size_t commands() const { return commands_.size(); }
+
+   private:
+    struct Item {
+        enum Kind { kText, kRule, kRange } kind;
+        std::string text;  // literal text, or rule name
+        uint32_t lo = 0, hi = 0;
+        int line = 0;
+    };
+    struct Alternative {
+        std::vector<Item> items;
+        uint32_t weight = 1;
+    };
+    struct Rule {
+        std::string name;
+        std::vector<Alternative> alternatives;
+        bool weighted = false;
+        int line = 0;
+    };
+
+    [[noreturn]] void fail(int line, char const* what, std::string_view detail = {}) const {
+        fprintf(stderr, "%s:%d: %s%s%.*s\n", source_, line, what,
+                detail.empty() ? "" : ": ", int(detail.size()), detail.data());
+        exit(EXIT_FAILURE);
+    }
+
+    // Tokenising.
+
+    void skip_space() {
+        while (pos_ < text_.size()) {
+            char c = text_[pos_];
+            if (c == '#') {
+                while (pos_ < text_.size() && text_[pos_] != '\n') pos_++;
+            } else if (c == '\n') {
+                line_++;
+                pos_++;
+            } else if (c == ' ' || c == '\t' || c == '\r') {
+                pos_++;
+            } else {
+                break;
+            }
+        }
+    }
+    int peek() {
+        skip_space();
+        return pos_ < text_.size() ? (unsigned char)text_[pos_] : EOF;
+    }
+    bool accept(char c) {
+        if (peek() != c) return false;
+        pos_++;
+        return true;
+    }
+    void expect(char c) {
+        if (!accept(c)) fail(line_, "expected", std::string_view(&c, 1));
+    }
+    static bool is_name_start(int c) {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+    }
+    static bool is_name(int c) {
+        return is_name_start(c) || (c >= '0' && c <= '9');
+    }
+    std::string name() {
+        if (!is_name_start(peek())) fail(line_, "expected a rule name");
+        size_t start = pos_;
+        while (pos_ < text_.size() && is_name(text_[pos_])) pos_++;
+        return std::string(text_.substr(start, pos_ - start));
+    }
+    uint32_t number() {
+        peek();
+        size_t start = pos_;
+        uint64_t n = 0;
+        while (pos_ < text_.size() && text_[pos_] >= '0' && text_[pos_] <= '9') {
+            n = n * 10 + (text_[pos_++] - '0');
+            if (n > UINT32_MAX) fail(line_, "number too large");
+        }
+        if (pos_ == start) fail(line_, "expected a number");
+        return uint32_t(n);
+    }
+    static int hex(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+    std::string quoted() {
+        expect('"');
+        std::string s;
+        for (;;) {
+            if (pos_ >= text_.size() || text_[pos_] == '\n') fail(line_, "unterminated string");
+            char c = text_[pos_++];
+            if (c == '"') break;
+            if (c != '\\') {
+                s += c;
+                continue;
+            }
+            if (pos_ >= text_.size()) fail(line_, "unterminated string");
+            switch (c = text_[pos_++]) {
+            case 'n': s += '\n'; break;
+            case 't': s += '\t'; break;
+            case 'r': s += '\r'; break;
+            case '"': s += '"'; break;
+            case '\\': s += '\\'; break;
+            case 'x': {
+                int h = pos_ + 1 < text_.size() ? hex(text_[pos_]) : -1;
+                int l = h >= 0 ? hex(text_[pos_ + 1]) : -1;
+                if (l < 0) fail(line_, "bad \\x escape");
+                s += char(h << 4 | l);
+                pos_ += 2;
+                break;
+            }
+            default:
+                fail(line_, "unknown escape", std::string_view(&c, 1));
+            }
+        }
+        if (s.size() > UINT16_MAX) fail(line_, "literal too long");
+        return s;
+    }
+
+    // Parsing.
+
+    void parse() {
+        while (peek() != EOF) {
+            Rule rule;
+            rule.line = line_;
+            rule.name = name();
+            expect('=');
+            do {
+                rule.alternatives.push_back(alternative());
+                if (rule.alternatives.back().weight != 1) rule.weighted = true;
+            } while (accept('|'));
+            expect(';');
+            if (rule.weighted && rule.alternatives.size() > 1) {
+                uint64_t total = 0;
+                for (auto const& alt : rule.alternatives) total += alt.weight;
+                if (total == 0) fail(rule.line, "all weights are zero");
+            }
+            if (!rule_index_.emplace(rule.name, rules_.size()).second) {
+                fail(rule.line, "rule defined twice", rule.name);
+            }
+            rules_.push_back(std::move(rule));
+        }
+        if (rules_.empty()) fail(line_, "no rules");
+    }
+
+    Alternative alternative() {
+        Alternative alt;
+        for (;;) {
+            int c = peek();
+            Item item;
+            item.line = line_;
+            if (c == '"') {
+                item.kind = Item::kText;
+                item.text = quoted();
+                literals_parsed_++;
+            } else if (is_name_start(c)) {
+                item.kind = Item::kRule;
+                item.text = name();
+            } else if (c == '{') {
+                pos_++;
+                item.kind = Item::kRange;
+                item.lo = number();
+                expect('-');
+                item.hi = number();
+                expect('}');
+                if (item.hi < item.lo || item.hi - item.lo == UINT32_MAX
+                    || item.lo > 0xffffff) {
+                    fail(item.line, "bad range");
+                }
+            } else {
+                break;
+            }
+            alt.items.push_back(std::move(item));
+        }
+        if (accept('@')) alt.weight = number();
+        return alt;
+    }
+
+    // Code generation, following GenBuilder.
+
+    // Keys are views of the parsed text or of numbers_, both of which
+    // outlive code generation.
+    LPIndex add_string(std::string_view s) {
+        auto [it, added] = literal_index_.try_emplace(s, LPIndex(headers_.size()));
+        if (added) {
+            if (headers_.size() > 0xffffff) fail(line_, "too many literals");
+            size_t offset = storage_.size();
+            headers_.emplace_back(s, storage_);
+            // LiteralHeader holds the encoded length in 16 bits.
+            if (storage_.size() - offset > UINT16_MAX) fail(line_, "literal too long once encoded");
+        }
+        return it->second;
+    }
+
+    MLPtr next_op() const {
+        return MLPtr{uint32_t(commands_.size())};
+    }
+
+    void ingest(Item const& item) {
+        switch (item.kind) {
+        case Item::kText:
+            commands_.push_back(detail::kLiteral.arg(add_string(item.text)));
+            break;
+        case Item::kRule: {
+            auto it = rule_index_.find(item.text);
+            if (it == rule_index_.end()) fail(item.line, "undefined rule", item.text);
+            fixups_.push_back({uint32_t(commands_.size()), it->second});
+            commands_.push_back(detail::kCall);
+            break;
+        }
+        case Item::kRange:
+            if (item.hi == item.lo) {
+                numbers_.push_back(detail::integer_text(item.lo));
+                commands_.push_back(detail::kLiteral.arg(add_string(numbers_.back())));
+                break;
+            }
+            if (item.hi - item.lo < detail::max_literal_pick<T>()) {
+                commands_.push_back(detail::kLiteralPick.arg(item.hi - item.lo + 1));
+                for (uint32_t n = item.lo; n <= item.hi; ++n) {
+                    numbers_.push_back(detail::integer_text(n));
+                    commands_.push_back(detail::kLiteral.arg(add_string(numbers_.back())));
+                }
+                break;
+            }
+            commands_.push_back(detail::kRandInt.arg(item.lo));
+            commands_.push_back(MLOp{item.hi - item.lo + 1});
+            break;
+        }
+    }
+
+    MLPtr sequence(std::vector<Item> const& items) {
+        MLPtr result = next_op();
+        for (auto const& item : items) ingest(item);
+        if (!items.empty() && items.back().kind != Item::kRange) {
+            commands_.back() = detail::tail(commands_.back());
+        } else {
+            commands_.push_back(detail::kReturn);
+        }
+        return result;
+    }
+
+    MLPtr pick(Rule const& rule) {
+        auto const& alts = rule.alternatives;
+        uint32_t len = alts.size();
+        if (rule.weighted && len > 0xffff) fail(rule.line, "too many weighted alternatives");
+        if (len > 0xffffff) fail(rule.line, "too many alternatives");
+
+        // As with nested ml() calls, compound entries are emitted first.
+        auto simple = [](Alternative const& alt) {
+            return alt.items.size() == 1 && alt.items[0].kind != Item::kRange;
+        };
+        std::vector<MLPtr> compound(len);
+        bool literals = true;
+        for (uint32_t k = 0; k < len; ++k) {
+            if (!alts[k].items.empty() && !simple(alts[k])) {
+                compound[k] = sequence(alts[k].items);
+            }
+            if (!alts[k].items.empty() && !(simple(alts[k]) && alts[k].items[0].kind == Item::kText)) {
+                literals = false;
+            }
+        }
+
+        MLPtr result = next_op();
+        if (rule.weighted) {
+            commands_.push_back(detail::kAlias.arg(len));
+            std::vector<uint64_t> weights;
+            for (auto const& alt : alts) weights.push_back(alt.weight);
+            std::vector<uint32_t> worklist(len);
+            detail::append_alias_table(commands_, weights, worklist);
+        } else {
+            commands_.push_back((literals ? detail::kLiteralArray : detail::kArray).arg(len));
+        }
+        for (uint32_t k = 0; k < len; ++k) {
+            if (alts[k].items.empty()) {
+                commands_.push_back(detail::kLiteral.arg(add_string("")));
+            } else if (simple(alts[k])) {
+                ingest(alts[k].items[0]);
+            } else {
+                commands_.push_back(detail::kCall.arg(compound[k].address));
+            }
+            commands_.back() = detail::tail(commands_.back());
+        }
+        return result;
+    }
+
+    void emit() {
+        literal_index_.reserve(literals_parsed_);
+        storage_.reserve(text_.size());
+        std::vector<MLPtr> addresses;
+        for (auto const& rule : rules_) {
+            line_ = rule.line;
+            if (rule.alternatives.size() == 1) {
+                addresses.push_back(sequence(rule.alternatives[0].items));
+            } else {
+                addresses.push_back(pick(rule));
+            }
+            if (commands_.size() > 0xffffff) fail(rule.line, "grammar too large");
+        }
+        for (auto const& [at, rule] : fixups_) {
+            commands_[at] = MLOp{commands_[at].op() | addresses[rule].address};
+        }
+        auto start = rule_index_.find("start");
+        entry_ = addresses[start != rule_index_.end() ? start->second : 0];
+    }
+
+    char const* source_;
+    std::string_view text_;
+    size_t pos_ = 0;
+    int line_ = 1;
+    std::vector<Rule> rules_;
+    size_t literals_parsed_ = 0;
+    std::unordered_map<std::string, uint32_t> rule_index_;
+    std::unordered_map<std::string_view, LPIndex> literal_index_;
+    std::deque<std::string> numbers_;  // text of the ranges' literals
+    std::vector<std::pair<uint32_t, uint32_t>> fixups_;  // command, rule
+
+    std::vector<uint8_t> storage_;
+    std::vector<LiteralHeader> headers_;
+    std::vector<MLOp> commands_;
+    MLPtr entry_;
+};
+
+}  // namespace ML
+
+#endif  // !defined(GRAMMAR_H_INCLUDED)
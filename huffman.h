@@ -1,6 +1,11 @@
 #if !defined(HUFFMAN_H_INCLUDED)
 #define HUFFMAN_H_INCLUDED
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <string_view>
+
 #include "stuffer.h"
 
 #if defined(__clang__)
@@ -48,8 +53,12 @@ class HuffmanTable {
     constexpr size_t size() const { return N; }
 };
 
-class Defl8bitTableBuilder {
-    static constexpr int get_literal_length(int i) {
+// Code lengths for the byte-aligned profile: every literal, and every
+// match/distance tuple, is a whole number of bytes.
+struct Defl8bitLengths {
+    static constexpr int kAlignBits = 8;
+
+    static constexpr int literal(int i) {
         constexpr uint8_t control[32] = {
             9, 9, 9, 9, 9, 9, 9, 8,
             8, 8, 8, 8, 8, 8, 0, 0,
@@ -76,149 +85,221 @@ class Defl8bitTableBuilder {
         return 0;
     }
 
-    static constexpr int get_distance_length(int i) {
+    static constexpr int distance(int i) {
         int extra_bits = std::max(0, i - 2) >> 1;
         return 15 - extra_bits;
     }
 
-    class DeflateHeader {
-        static constexpr void try_length_lengths(std::array<uint8_t, 19>& lenlens, std::array<uint16_t, 19>& hist, int tweak = 0) {
-            // TODO: build a proper Huffman table from hist, then tweak it
-            // until it fits.
-            constexpr uint8_t lentab[19] = {
-                7, 7, 6, 6, 6, 6, 6, 7,
-                4, 5, 4, 5, 6, 6, 6, 7,
-                1, 3, 5,
-            };
-            for (size_t i = 0; i < lenlens.size(); ++i) {
-                int j = i <= 15 ? i * (tweak * 2 + 1) & 15 : i;
-                lenlens[i] = lentab[j];
-            }
+    // Distances up to kNearDistance make 2-byte tuples, and those past
+    // kFarDistance 4-byte ones (see Defl8bitNearLengths); the rest are 3.
+    static constexpr int kNearDistance = 0;
+    static constexpr int kFarDistance = 32768;
+};
+
+// As Defl8bitLengths, but distances up to 32 come to 7 bits with their
+// extra bits, for 2-byte backrefs.  In whole bytes the distance code can
+// only pay for that by pushing its last code (24577-32768) out to 23 bits,
+// for 4-byte backrefs, so this suits grammars whose repeats are mostly
+// short and close together; the literal code is untouched.
+struct Defl8bitNearLengths : Defl8bitLengths {
+    static constexpr int distance(int i) {
+        int extra_bits = std::max(0, i - 2) >> 1;
+        return (i < 10 ? 7 : i < 29 ? 15 : 23) - extra_bits;
+    }
+
+    static constexpr int kNearDistance = 32;
+    static constexpr int kFarDistance = 24576;
+};
+
+// Code lengths for the nibble-aligned profile: every literal and every
+// match/distance tuple is a whole number of nibbles.  The eight commonest
+// characters of English text get 4-bit codes, which costs the
+// match lengths some code space: lengths up to 66 make a 9-bit length
+// code plus extra bits (for a 24-bit tuple), and longer ones 13 bits (28).
+// Every code length is at most 13.
+struct Defl4bitLengths {
+    static constexpr int kAlignBits = 4;
+
+    static constexpr int literal(int i) {
+        constexpr std::string_view kShort = " etasino";
+        constexpr std::string_view kRare = "`^{|}~";
+        if (i < 0x80) {
+            if (kShort.find(char(i)) != kShort.npos) return 4;
+            if (kRare.find(char(i)) != kRare.npos) return 12;
+            if (i >= 0x20 && i < 0x7f) return 8;
+            if (i == '\n') return 8;
+            if (i == '\t' || i == '\r' || (0x01 <= i && i <= 0x04)) return 12;
+            return 0;
+        }
+        if (0x80 <= i && i <= 0xbf) return 12;  // UTF-8 continuation
+        if (0xc2 <= i && i <= 0xf4) return 12;  // UTF-8 lead
+        if (i == 256) return 12;                // end of block
+        // Lengths totalling 9 or 13 bits with their extra bits, so that
+        // with a 15-bit distance a backref is 6 or 7 nibbles.  285 is
+        // never used (258 goes as 284 + 31), which makes room for the rest.
+        if (257 <= i && i <= 284) {
+            int j = i - 257;
+            int extra_bits = std::max(0, j - 4) >> 2;
+            return (j < 20 ? 9 : 13) - extra_bits;
         }
+        return 0;
+    }
+
+    static constexpr int distance(int i) {
+        return Defl8bitLengths::distance(i);
+    }
+};
 
-        static constexpr void output(std::array<uint16_t, 19>& hist, HuffmanTable<19> const*, int code, int = 0) {
-            hist[code]++;
+// The dynamic Huffman block header describing Lengths' codes, arranged to
+// end on a multiple of Lengths::kAlignBits bits.
+template <typename Lengths>
+class DeflateHeader {
+    static constexpr void try_length_lengths(std::array<uint8_t, 19>& lenlens, std::array<uint16_t, 19>& hist, int tweak = 0) {
+        // TODO: build a proper Huffman table from hist, then tweak it
+        // until it fits.
+        constexpr uint8_t lentab[19] = {
+            7, 7, 6, 6, 6, 6, 6, 7,
+            4, 5, 4, 5, 6, 6, 6, 7,
+            1, 3, 5,
+        };
+        for (size_t i = 0; i < lenlens.size(); ++i) {
+            int j = i <= 15 ? (i * (tweak * 2 + 1) + tweak / 32) & 15 : i;
+            lenlens[i] = lentab[j];
         }
+    }
 
-        static constexpr void output(BitStuffer& out, HuffmanTable<19> const* lencodes, int code, int arg = 0) {
-            out.wr((*lencodes)[code]);
-            switch (code) {
-            case 16: out.wr(2, arg); break;
-            case 17: out.wr(3, arg); break;
-            case 18: out.wr(7, arg); break;
-            }
+    static constexpr void output(std::array<uint16_t, 19>& hist, HuffmanTable<19> const*, int code, int = 0) {
+        hist[code]++;
+    }
+
+    static constexpr void output(BitStuffer& out, HuffmanTable<19> const* lencodes, int code, int arg = 0) {
+        out.wr((*lencodes)[code]);
+        switch (code) {
+        case 16: out.wr(2, arg); break;
+        case 17: out.wr(3, arg); break;
+        case 18: out.wr(7, arg); break;
         }
+    }
 
-        template <typename T>
-        static constexpr void rle_header(T& out, HuffmanTable<19>* lencodes = nullptr) {
-            int previous = -1;
-            int count = 0;
-
-            auto flush = [&out, lencodes, &previous, &count]() {
-                int len = previous;
-                previous = -1;
-                if (count == 0) return;
-                if (len == 0) {
-                    while (count >= 11) {
-                        int run = std::min(138, count);
-                        output(out, lencodes, 18, run - 11);
-                        count -= run;
-                    }
-                    while (count >= 3) {
-                        int run = std::min(10, count);
-                        output(out, lencodes, 17, run - 3);
-                        count -= run;
-                    }
-                } else {
-                    output(out, lencodes, len);
-                    count--;
-                    while (count >= 3) {
-                        int run = std::min(6, count);
-                        if (count - run == 1) run--;
-                        if (count - run == 2) run--;
-                        output(out, lencodes, 16, run - 3);
-                        count -= run;
-                    }
+    template <typename T>
+    static constexpr void rle_header(T& out, HuffmanTable<19>* lencodes = nullptr) {
+        int previous = -1;
+        int count = 0;
+
+        auto flush = [&out, lencodes, &previous, &count]() {
+            int len = previous;
+            previous = -1;
+            if (count == 0) return;
+            if (len == 0) {
+                while (count >= 11) {
+                    int run = std::min(138, count);
+                    output(out, lencodes, 18, run - 11);
+                    count -= run;
                 }
-                while (count > 0) {
-                    output(out, lencodes, len);
-                    count--;
+                while (count >= 3) {
+                    int run = std::min(10, count);
+                    output(out, lencodes, 17, run - 3);
+                    count -= run;
                 }
-            };
-
-            auto next_len = [&previous, &count, &flush](int len) {
-                if (len != previous) {
-                    flush();
-                    previous = len;
-                    count = 0;
+            } else {
+                output(out, lencodes, len);
+                count--;
+                while (count >= 3) {
+                    int run = std::min(6, count);
+                    if (count - run == 1) run--;
+                    if (count - run == 2) run--;
+                    output(out, lencodes, 16, run - 3);
+                    count -= run;
                 }
-                count++;
-            };
+            }
+            while (count > 0) {
+                output(out, lencodes, len);
+                count--;
+            }
+        };
 
-            for (int i = 0; i < 286; ++i) next_len(get_literal_length(i));
-            flush();
-            for (int i = 0; i < 30; ++i) next_len(get_distance_length(i));
-            flush();
-        }
+        auto next_len = [&previous, &count, &flush](int len) {
+            if (len != previous) {
+                flush();
+                previous = len;
+                count = 0;
+            }
+            count++;
+        };
 
-       public:
-        constexpr DeflateHeader() {
-            std::array<uint16_t, 19> hist = { 0 };
-            rle_header(hist);
-            size_t bit_length = SIZE_MAX;
-            std::array<uint8_t, 19> lenlens;
-            for (int tweak = 0; tweak < 32; ++tweak) {
-                try_length_lengths(lenlens, hist, tweak);
-                bit_length = 17 + 3 * 19;
-                for (int i = 0; i < 19; ++i) {
-                    int extra = 0;
-                    switch (i) {
-                    case 16: extra = 2; break;
-                    case 17: extra = 3; break;
-                    case 18: extra = 7; break;
-                    }
-                    bit_length += (lenlens[i] + extra) * hist[i];
+        for (int i = 0; i < 286; ++i) next_len(Lengths::literal(i));
+        flush();
+        for (int i = 0; i < 30; ++i) next_len(Lengths::distance(i));
+        flush();
+    }
+
+   public:
+    constexpr DeflateHeader() {
+        std::array<uint16_t, 19> hist = { 0 };
+        rle_header(hist);
+        size_t bit_length = SIZE_MAX;
+        std::array<uint8_t, 19> lenlens;
+        // Fitted tables (see Defl8bitFittedLengths) can take a while to
+        // land on a boundary, so there are plenty of tweaks to try.
+        for (int tweak = 0; tweak < 256; ++tweak) {
+            try_length_lengths(lenlens, hist, tweak);
+            bit_length = 17 + 3 * 19;
+            for (int i = 0; i < 19; ++i) {
+                int extra = 0;
+                switch (i) {
+                case 16: extra = 2; break;
+                case 17: extra = 3; break;
+                case 18: extra = 7; break;
                 }
-                if (bit_length % 8 == 0)
-                    break;
+                bit_length += (lenlens[i] + extra) * hist[i];
             }
-            assert(bit_length % 8 == 0);
-            lenlens_ = lenlens;
-            bit_length_ = bit_length;
+            if (bit_length % Lengths::kAlignBits == 0)
+                break;
         }
+        assert(bit_length % Lengths::kAlignBits == 0);
+        lenlens_ = lenlens;
+        bit_length_ = bit_length;
+    }
 
-        constexpr void get(std::span<uint8_t> output) const {
-            HuffmanTable<19> lencodes([this](int i) constexpr -> int { return lenlens_[i]; });
-
-            assert(output.size() == size());
-            BitStuffer out(output);
-            out.wr(1, 1);  // BFINAL
-            out.wr(2, 0x02);  // BTYPE dynamic Huffman
-            out.wr(5, 286 - 257);  // HLIT
-            out.wr(5, 30 - 1);  // HDIST
-            out.wr(4, 19 - 4);  // HCLEN
-            for (int i : {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15}) {
-                out.wr(3, lencodes[i].len);
-            }
-            rle_header(out, &lencodes);
-            out.done();
-        }
+    constexpr void get(std::span<uint8_t> output) const {
+        HuffmanTable<19> lencodes([this](int i) constexpr -> int { return lenlens_[i]; });
 
-        constexpr size_t size() const {
-            return (bit_length_ + 7) >> 3;
+        assert(output.size() == size());
+        BitStuffer out(output);
+        out.wr(1, 1);  // BFINAL
+        out.wr(2, 0x02);  // BTYPE dynamic Huffman
+        out.wr(5, 286 - 257);  // HLIT
+        out.wr(5, 30 - 1);  // HDIST
+        out.wr(4, 19 - 4);  // HCLEN
+        for (int i : {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15}) {
+            out.wr(3, lencodes[i].len);
         }
+        rle_header(out, &lencodes);
+        if (bit_length_ % 8 != 0) out.wr(8 - bit_length_ % 8, 0);
+        out.done();
+    }
 
-        std::array<uint8_t, 19> lenlens_;
-        size_t bit_length_;
-    };
+    constexpr size_t size() const {
+        return (bit_length_ + 7) >> 3;
+    }
 
+    constexpr size_t bit_length() const {
+        return bit_length_;
+    }
+
+    std::array<uint8_t, 19> lenlens_;
+    size_t bit_length_;
+};
+
+template <typename Lengths>
+class DeflateTableBuilder {
    public:
     const HuffmanTable<286> litcodes_;
     const HuffmanTable<30> distcodes_;
-    const DeflateHeader header_;
+    const DeflateHeader<Lengths> header_;
 
-    constexpr Defl8bitTableBuilder()
-        : litcodes_(get_literal_length), distcodes_(get_distance_length) {}
+    constexpr DeflateTableBuilder()
+        : litcodes_(Lengths::literal), distcodes_(Lengths::distance) {}
 
     constexpr void get_literals(std::array<uint16_t, 257>& output, std::array<uint8_t, 257>& outlen) const {
         for (int i = 0; i < 257; ++i) {
@@ -227,15 +308,20 @@ class Defl8bitTableBuilder {
         }
     }
 
-    constexpr void get_match_table(std::array<uint16_t, 259>& output) const {
+    // Length symbol and extra bits, by match length, and optionally the
+    // number of bits that makes.
+    constexpr void get_match_table(std::array<uint16_t, 259>& output,
+                                   std::array<uint8_t, 259>* bits = nullptr) const {
         int i = 0;
         for (int j = 0; j < 3; ++j) {
+            if (bits) (*bits)[i] = 0;
             output[i++] = 0;
         }
         for (int j = 0; j < 28; ++j) {
             auto const& c = litcodes_[257 + j];
             int extra_bits = std::max(0, j - 4) >> 2;
             for (int m = 0; m < (1 << extra_bits); ++m) {
+                if (bits) (*bits)[i] = c.len + extra_bits;
                 output[i++] = c.code | (m << c.len);
             }
         }
@@ -256,24 +342,200 @@ class Defl8bitTableBuilder {
     }
 };
 
+using Defl8bitTableBuilder = DeflateTableBuilder<Defl8bitLengths>;
+
+// Tables for Defl8bit, from any byte-aligned Lengths: Defl8bitLengths, or
+// a Defl8bitFittedLengths.  Not a template, so that a grammar's tables can
+// be declared (extern) apart from the grammar they're fitted to.
 struct Defl8bitTables {
+    // Enough for any set of code lengths.
+    static constexpr size_t kMaxHeaderSize = 576;
+
     std::array<uint16_t, 257> litcode_;
     std::array<uint8_t, 257> litcodelen_;
     std::array<uint16_t, 259> match_table_;
-    std::array<uint16_t, 32769> dist_table_;
-    std::array<uint8_t, Defl8bitTableBuilder().header_.size()> header_blob_;
+    std::array<uint16_t, 32769> dist_table_;  // up to far_distance_
+    std::array<uint8_t, kMaxHeaderSize> header_blob_;
+    size_t header_size_;
+    uint32_t near_distance_, far_distance_;
+    // Past far_distance_, the last distance code and its extra bits.
+    uint16_t far_code_;
+    uint8_t far_code_len_;
 
-    constexpr Defl8bitTables() {
-        constexpr Defl8bitTableBuilder builder;
+    template <typename Lengths>
+    constexpr explicit Defl8bitTables(Lengths) {
+        static_assert(Lengths::kAlignBits == 8);
+        static_assert(Lengths::kFarDistance == 32768 || Lengths::kFarDistance == 24576,
+                      "only the last distance code can be far");
+        constexpr DeflateTableBuilder<Lengths> builder;
+        static_assert(builder.header_.size() <= kMaxHeaderSize);
         builder.get_literals(litcode_, litcodelen_);
         builder.get_match_table(match_table_);
         builder.get_dist_table(dist_table_);
+        near_distance_ = Lengths::kNearDistance;
+        far_distance_ = Lengths::kFarDistance;
+        far_code_ = builder.distcodes_[29].code;
+        far_code_len_ = builder.distcodes_[29].len;
+        header_size_ = builder.header_.size();
+        header_blob_ = {};
+        builder.header_.get(std::span(header_blob_).first(header_size_));
+    }
+
+    constexpr std::span<const uint8_t> header() const {
+        return std::span(header_blob_).first(header_size_);
+    }
+
+    // Bytes in a backref's length/distance tuple.
+    constexpr int tuple_bytes(uint32_t distance) const {
+        return 3 - (distance <= near_distance_) + (distance > far_distance_);
+    }
+
+    // A distance's code and extra bits.
+    constexpr uint32_t distance_bits(uint32_t distance) const {
+        if (distance <= far_distance_) return dist_table_[distance];
+        return far_code_ | (distance - far_distance_ - 1) << far_code_len_;
+    }
+};
+
+// Byte-aligned code lengths fitted to the bytes of a grammar's literal
+// text.  ASCII has to stay at 8 bits, and lengths and distances are as in
+// Base (Defl8bitLengths or Defl8bitNearLengths), but only bytes which occur (and the digits, for
+// integer()) get codes.  The code space that frees goes to UTF-8: the
+// lead and continuation lengths are the ones which cost the histogram
+// least, subject to each character coming to a whole number of bytes.
+// Whatever space is left is padding on bytes which never occur.
+template <typename Base>
+constexpr std::array<uint8_t, 286> defl8bit_fitted_lengths(std::array<uint32_t, 256> const& histogram) {
+    std::array<uint8_t, 286> lengths{};
+    int units = 0;  // code space taken, out of 1 << 15
+    auto take = [&](int i, int len) {
+        lengths[i] = len;
+        units += 1 << (15 - len);
+    };
+    for (int i = 256; i < 286; ++i) {
+        if (int len = Base::literal(i)) take(i, len);
+    }
+
+    // As Defl8bit::encode_literal() classifies them: continuation bytes,
+    // then leads of 2, 3 and 4-byte sequences.
+    auto utf8_class = [](int b) {
+        return b < 0x80 ? -1 : b < 0xc0 ? 0 : b < 0xe0 ? 1 : b < 0xf0 ? 2 : b < 0xf8 ? 3 : -1;
+    };
+    uint64_t count[4] = {};
+    int distinct[4] = {};
+    int spare = 0;
+    for (int b = 0; b < 256; ++b) {
+        bool used = histogram[b] > 0 || (b >= '0' && b <= '9');
+        if (used && b < 0x80) {
+            take(b, 8);
+        } else if (used && utf8_class(b) >= 0) {
+            count[utf8_class(b)] += histogram[b];
+            distinct[utf8_class(b)]++;
+        } else {
+            spare++;
+        }
+    }
+
+    // A lead of a k+1 byte sequence and its k continuations must come to a
+    // multiple of 8 bits, so each lead has two candidate lengths.
+    uint64_t best_cost = UINT64_MAX;
+    int best[4] = {};
+    for (int cont = 1; cont <= 15; ++cont) {
+        for (int choice = 0; choice < 8; ++choice) {
+            int len[4] = {cont};
+            for (int k = 1; k < 4; ++k) {
+                len[k] = (8 - k * cont % 8) % 8 + (choice >> (k - 1) & 1) * 8;
+                if (len[k] == 0) len[k] = 8;
+            }
+            uint64_t cost = 0;
+            int space = units;
+            bool fits = true;
+            for (int k = 0; k < 4; ++k) {
+                if (distinct[k] == 0) continue;
+                if (len[k] > 15) fits = false;
+                cost += count[k] * len[k];
+                space += distinct[k] << (15 - std::min(len[k], 15));
+            }
+            int padding = (1 << 15) - space;
+            if (!fits || padding < 0 || std::popcount(unsigned(padding)) > spare) continue;
+            if (cost < best_cost) {
+                best_cost = cost;
+                std::copy(len, len + 4, best);
+            }
+        }
+    }
+    assert(best_cost != UINT64_MAX);
+    for (int b = 0; b < 256; ++b) {
+        int k = utf8_class(b);
+        if (k >= 0 && (histogram[b] > 0)) take(b, best[k]);
+    }
+
+    // Padding from the top down, where it's least likely to break up a
+    // run of zeroes in the block header.
+    for (int len = 1, b = 255; len <= 15; ++len) {
+        if (((1 << 15) - units) & (1 << (15 - len))) {
+            while (lengths[b] != 0) --b;
+            take(b, len);
+        }
+    }
+    assert(units == 1 << 15);
+    return lengths;
+}
+
+template <std::array<uint32_t, 256> Histogram, typename Base = Defl8bitLengths>
+struct Defl8bitFittedLengths : Base {
+    static constexpr std::array<uint8_t, 286> kLiteral = defl8bit_fitted_lengths<Base>(Histogram);
+
+    static constexpr int literal(int i) {
+        return kLiteral[i];
+    }
+};
+
+template <typename Lengths>
+constexpr int kraft_sum() {
+    int sum = 0;
+    for (int i = 0; i < 286; ++i) {
+        if (int len = Lengths::literal(i)) sum += 1 << (15 - len);
+    }
+    return sum;
+}
+static_assert(kraft_sum<Defl4bitLengths>() == 1 << 15, "incomplete code");
+
+template <typename Lengths>
+constexpr int distance_kraft_sum() {
+    int sum = 0;
+    for (int i = 0; i < 30; ++i) sum += 1 << (15 - Lengths::distance(i));
+    return sum;
+}
+static_assert(distance_kraft_sum<Defl8bitNearLengths>() == 1 << 15, "incomplete code");
+
+using Defl4bitTableBuilder = DeflateTableBuilder<Defl4bitLengths>;
+
+struct Defl4bitTables {
+    std::array<uint16_t, 257> litcode_;
+    std::array<uint8_t, 257> litcodelen_;
+    std::array<uint16_t, 259> match_table_;
+    std::array<uint8_t, 259> match_bits_;
+    std::array<uint16_t, 32769> dist_table_;
+    std::array<uint8_t, Defl4bitTableBuilder().header_.size()> header_blob_;
+    size_t header_nibbles_;
+
+    constexpr Defl4bitTables() {
+        constexpr Defl4bitTableBuilder builder;
+        builder.get_literals(litcode_, litcodelen_);
+        builder.get_match_table(match_table_, &match_bits_);
+        builder.get_dist_table(dist_table_);
         builder.header_.get(header_blob_);
+        header_nibbles_ = builder.header_.bit_length() / 4;
     }
 };
 
+// The default tables, for text in general.  Not in an anonymous namespace,
+// since encoder types take their tables as a template argument.
+inline constexpr Defl8bitTables hufftable{Defl8bitLengths{}};
+
 namespace {
-constexpr Defl8bitTables hufftable;
+constexpr Defl4bitTables nibbletable;
 }
 
 #endif  // !defined(HUFFMANH_H_INCLUDED)
@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <ctime>
 #include <span>
+#include <type_traits>
 #include <vector>
 
 #include <unistd.h>
@@ -13,22 +14,144 @@
 #include "defl8bit.h"
 #include "ml.h"
 #include "catfacts.h"
+#include "grammar.h"
+#include "packfile.h"
+#include "profile.h"
+#include "parallel.h"
+#include "seekindex.h"
+#include "server.h"
+#include "sink.h"
+
+// Accepts a K, M or G suffix (binary multiples).
+static uint64_t parse_size(char const* s) {
+    char* end;
+    uint64_t size = strtoull(s, &end, 0);
+    switch (*end) {
+    case 'G': case 'g': size <<= 10; [[fallthrough]];
+    case 'M': case 'm': size <<= 10; [[fallthrough]];
+    case 'K': case 'k': size <<= 10;
+    }
+    return size;
+}
+
+// Room in each output buffer beyond the flush limit: the longest literal
+// LiteralHeader can describe, plus the encoder's own overshoot (a pending
+// match, a block boundary, the wr4() scribble).
+static constexpr size_t kHeadroom = UINT16_MAX + 0x4000;
+
+template <typename T, typename Report>
+static void generate(OutputSink& sink, ML::Generator<T> const& gen,
+                     uint64_t size, uint64_t seed, uint64_t offset, Report&& report) {
+    // From the nearest checkpoint.  This builds the index first, so it
+    // shows the checkpoints work rather than saving any time.
+    if constexpr (requires(T& t, typename T::Checkpoint const& c) { t.resume(c); }) {
+        if (offset > 0) {
+            SeekIndex<T> index(gen, seed, size, 0x100000, time(NULL));
+            index.generate(sink, offset);
+            return;
+        }
+    }
+    T enc(sink.buffer());
+    if constexpr (requires { enc.head(); }) enc.head(time(NULL));
+    enc.seed(seed);
+    // Each entry is decoded a buffer's worth at a time.  decode() only
+    // checks the budget between commands, and not inside a cached
+    // subtree, so what it writes past sink.limit() is one literal (the
+    // headroom allows for the longest, see kHeadroom) or the rest of an
+    // open subtree, which only a GenBuilder grammar has and whose
+    // expansions have to be small enough to fit.
+    typename ML::Generator<T>::Cursor cursor;
+    uint32_t last = 0;
+    for (uint64_t done = 0; done < size;) {
+        bool finished;
+        do {
+            finished = gen.decode(enc, cursor, sink.limit());
+            assert(enc.size() <= sink.buffer().size());
+            if (enc.size() >= sink.limit()) {
+                auto next = sink.flush(enc.size());
+                enc.reset(next, sink.history());
+                if (Profile::take_request()) report();
+            }
+        } while (!finished);
+        uint32_t position = std::get<0>(enc.tell());
+        done += uint32_t(position - last);
+        last = position;
+    }
+    if constexpr (requires { enc.tail(); }) enc.tail();
+    sink.finish(enc.size());
+    if constexpr (Profile::kEnabled) report();
+}
+
+// Either the built-in grammar or one loaded from grammar_path, which may
+// be a text grammar or a pack file.  The built-in grammar's encoder B may
+// have tables fitted to it, where a loaded one uses T's general ones.
+template <typename T, typename B = T>
+static void generate(OutputSink& sink, char const* grammar_path,
+                     ML::Generator<B> const& builtin, uint64_t size, uint64_t seed,
+                     uint64_t offset) {
+    if (grammar_path == nullptr) {
+        generate(sink, builtin, size, seed, offset, []() { catfacts.report(stderr); });
+        return;
+    }
+    if (PackFile::is_pack(grammar_path)) {
+        PackFile pack(grammar_path);
+        auto gen = pack.generator<T>();
+        generate(sink, gen, size, seed, offset, [&]() { gen.report(stderr); });
+        return;
+    }
+    auto grammar = ML::Grammar<T>::load(grammar_path);
+    auto gen = grammar.generator();
+    generate(sink, gen, size, seed, offset, [&]() { gen.report(stderr); });
+}
 
 int main(int argc, char * const* argv) {
-    int size = 32768;
+    uint64_t size = 32768;
+    uint64_t offset = 0;
     int compressed = false;
+    bool nibbles = false;
+    bool zlib = false;
+    bool discard = false;
+    bool splice = false;
     uint64_t seed = time(NULL);
+    int port = -1;
+    int workers = 0;
+    int drip_interval = 0;
+    size_t drip_bytes = 64;
+    bool sized = false;
+    char const* grammar_path = nullptr;
 
     int opt;
-    while ((opt = getopt(argc, argv, "zs:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "z4Znvs:l:o:S:j:d:b:cg:")) != -1) {
         switch (opt) {
         case 'z': compressed = true;
             break;
-        case 'l': size = strtoull(optarg, nullptr, 0);
+        case '4': compressed = nibbles = true;
+            break;
+        case 'Z': compressed = zlib = true;
+            break;
+        case 'n': discard = true;
+            break;
+        case 'v': splice = true;
+            break;
+        case 'l': size = parse_size(optarg);
+            break;
+        case 'o': offset = parse_size(optarg);
             break;
         case 's': seed = strtoull(optarg, nullptr, 0);
             break;
-        default: fprintf(stderr, "Usage: %s [-z] [-l length] [-s seed]\n",
+        case 'S': port = strtoul(optarg, nullptr, 0);
+            break;
+        case 'j': workers = strtoul(optarg, nullptr, 0);
+            break;
+        case 'd': drip_interval = strtoul(optarg, nullptr, 0);
+            break;
+        case 'b': drip_bytes = strtoull(optarg, nullptr, 0);
+            break;
+        case 'c': sized = true;
+            break;
+        case 'g': grammar_path = optarg;
+            break;
+        default: fprintf(stderr, "Usage: %s [-z | -4 | -Z] [-n | -v] [-l length [-o offset]] [-s seed] [-g grammar] [-j threads] [-S port [-c] [-d drip_ms [-b drip_bytes]]]\n",
                          argv[0]);
             exit(EXIT_FAILURE);
         }
@@ -38,45 +161,56 @@ int main(int argc, char * const* argv) {
         exit(EXIT_FAILURE);
     }
 
-    static constexpr size_t kBufferSafety = 0x4000;
-    static constexpr size_t kBufferSize = 0x100000 + kBufferSafety;
-    static constexpr size_t kBufferLimit = kBufferSize - kBufferSafety;
-    std::array<uint8_t, kBufferSize> buffer;
+    if (grammar_path != nullptr && (port >= 0 || workers > 1)) {
+        fprintf(stderr, "-g is not supported with -S or -j yet.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (offset > 0 && (nibbles || port >= 0 || workers > 1)) {
+        fprintf(stderr, "-o is not supported with -4, -S or -j.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (nibbles && (port >= 0 || workers > 1)) {
+        fprintf(stderr, "-4 is not supported with -S or -j yet.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (zlib && (port >= 0 || workers > 1)) {
+        fprintf(stderr, "-Z is not supported with -S or -j yet.\n");
+        exit(EXIT_FAILURE);
+    }
 
-    if (compressed) {
-        GZip gz(buffer);
-        gz.head(time(NULL));
-        gz.seed(seed);
-        while (std::get<0>(gz.tell()) < size) {
-            catfacts.do_something(gz);
-            if (gz.size() >= kBufferLimit) {
-                assert(gz.size() < kBufferSize);
-                std::span<uint8_t> chunk(gz);
-                fwrite(chunk.data(), 1, chunk.size(), stdout);
-                gz.reset();
-            }
-        }
-        gz.tail();
-        std::span<uint8_t> chunk(gz);
-        fwrite(chunk.data(), 1, chunk.size(), stdout);
-        gz.reset();
+    if (port >= 0) {
+        ServerOptions options;
+        options.port = port;
+        options.length = size;
+        options.seed = seed;
+        options.workers = workers;
+        options.drip_interval = drip_interval;
+        options.drip_bytes = drip_bytes;
+        options.sized = sized;
+        return serve(options);
+    }
+
+    // The identity encoder copies backrefs out of its own output, so it
+    // keeps a deflate window's worth of that across flushes.  -v lends
+    // the output pages to a pipe rather than copying them, for a reader
+    // which read()s it (see sink.h).
+    OutputSink sink(discard ? -1 : STDOUT_FILENO, 0x100000, kHeadroom, 4, compressed ? 0 : 32768,
+                    splice);
+    Profile::report_on_signal();
+
+    if (workers > 1) {
+        generate_parallel(sink, compressed, size, seed, workers);
+        return 0;
+    }
+
+    if (nibbles) {
+        generate<GZip4>(sink, grammar_path, catfacts.gzip4_catfacts_, size, seed, offset);
+    } else if (zlib) {
+        generate<ZLib>(sink, grammar_path, catfacts.zlib_catfacts_, size, seed, offset);
+    } else if (compressed) {
+        generate<GZip>(sink, grammar_path, catfacts.gzip_catfacts_, size, seed, offset);
     } else {
-        RawData txt(buffer);
-        //txt.head(time(NULL));
-        txt.seed(seed);
-        while (std::get<0>(txt.tell()) < size) {
-            catfacts.do_something(txt);
-            if (txt.size() >= kBufferLimit) {
-                assert(txt.size() < kBufferSize);
-                std::span<uint8_t> chunk(txt);
-                fwrite(chunk.data(), 1, chunk.size(), stdout);
-                txt.reset();
-            }
-        }
-        //txt.tail();
-        std::span<uint8_t> chunk(txt);
-        fwrite(chunk.data(), 1, chunk.size(), stdout);
-        txt.reset();
+        generate<RawData>(sink, grammar_path, catfacts.raw_catfacts_, size, seed, offset);
     }
 
     return 0;
@@ -1,8 +1,19 @@
 #if !defined(ML_H_INCLUDED)
 #define ML_H_INCLUDED
 
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <numeric>
+#include <source_location>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
 #include "defl8bit.h"
 #include "inplace_vector.h"
+#include "profile.h"
 
 namespace ML {
 
@@ -10,6 +21,17 @@ struct MLPtr {
     uint32_t address;
 };
 
+// A pick() entry chosen `weight` times as often as an unweighted one.
+template <typename A>
+struct Weighted {
+    uint32_t weight;
+    A entry;
+};
+template <typename A>
+constexpr Weighted<A> weight(uint32_t w, A entry) {
+    return Weighted<A>{w, entry};
+}
+
 namespace detail {
 
 using LPIndex = typename EncoderLiteral::LPIndex;
@@ -23,12 +45,56 @@ struct MLOp {
 struct RandInt {
     uint32_t lo, hi;
 };
+// Where a production was made, for Generator::report(): the GenBuilder
+// call's file and line.  Only kept under DEFL8BIT_PROFILE.
+struct Site {
+    char const* file = nullptr;
+    uint32_t line = 0;
+};
 static constexpr MLOp kCall{0x00000000};
 static constexpr MLOp kReturn{0xff000000};
 static constexpr MLOp kArray{0xfe000000};
 static constexpr MLOp kLiteral{0xfd000000};
 static constexpr MLOp kRandInt{0xfc000000};
 static constexpr MLOp kProbability{0xfb000000};
+// Fused forms emitted by GenBuilder; see decode().
+static constexpr MLOp kJump{0xfa000000};           // kCall + kReturn
+static constexpr MLOp kLiteralReturn{0xf9000000};  // kLiteral + kReturn
+static constexpr MLOp kLiteralArray{0xf8000000};   // kArray over literals only
+// Weighted pick: n alias table words (threshold in the low 16 bits, alias
+// index in the high 16), then n entries as for kArray.
+static constexpr MLOp kAlias{0xf7000000};
+// Subtree cache: kSubtree opens an expansion of cache slot `arg`, and the
+// matching kSubtreeEnd closes it and returns.  GenBuilder::cached() wraps
+// a call in the pair.
+static constexpr MLOp kSubtree{0xf6000000};
+static constexpr MLOp kSubtreeEnd{0xf5000000};
+// A RandInt over a small range, as n literal entries (the numbers' text)
+// which it picks from, then carries on after, rather than returning.
+static constexpr MLOp kLiteralPick{0xf4000000};
+
+// The widest RandInt range which becomes a kLiteralPick for T, so each
+// number is a blob, with its code and checksum worked out ahead of time,
+// and a repeat can go out as a backref.  That's T::kMaxLiteralPick, or 0
+// (always kRandInt) for an encoder which doesn't say: for Defl8bit the
+// pick's mix of hits and misses costs more than integer() saves.
+template <typename T>
+constexpr uint32_t max_literal_pick() {
+    if constexpr (requires { T::kMaxLiteralPick; }) {
+        return T::kMaxLiteralPick;
+    } else {
+        return 0;
+    }
+}
+
+constexpr std::string integer_text(uint32_t value) {
+    std::string s;
+    do {
+        s.insert(s.begin(), char('0' + value % 10));
+        value /= 10;
+    } while (value > 0);
+    return s;
+}
 
 template <typename T>
 struct Generator {
@@ -50,8 +116,27 @@ struct Generator {
         std::array<LiteralHeader, sizes[1]> headers;
         std::array<MLOp, sizes[2]> commands;
         MLPtr entry;
+#if defined(DEFL8BIT_PROFILE)
+        std::array<Site, sizes[2]> sites;  // by command address
+#endif
     };
 
+    // Index into decode()'s handler table: kLiteralPick..kReturn map to
+    // 0..11, kCall to 12 and anything else to 13.
+    static constexpr uint32_t handler(MLOp c) {
+        uint32_t h = ((c.word_ >> 24) - (kLiteralPick.word_ >> 24)) & 0xff;
+        return h < 13 ? h : 13;
+    }
+
+    // Walker's alias method: one random number picks both a column and a
+    // point in it, and the column's threshold decides between the column
+    // and its alias.
+    static constexpr uint32_t alias_pick(std::span<const MLOp> table, uint32_t r) {
+        uint32_t column = r >> 16;
+        uint32_t word = table[column].word_;
+        return (r & 0xffff) < (word & 0xffff) ? column : word >> 16;
+    }
+
     constexpr EncoderLiteral blob_at(LPIndex i) const {
         return EncoderLiteral(headers_[i], storage_, i);
     }
@@ -67,49 +152,384 @@ struct Generator {
 
     template <std::array<size_t, 3> sizes>
     constexpr Generator(MLPack<sizes> const& pack)
-            : Generator(pack.storage, pack.headers, pack.commands, pack.entry) {}
-
-    void decode(T& out, MLPtr p, bool single = false) const {
-        //tuple<position,checksum> backrefs[8];
-        auto i = p.address;
-        do {
-            assert(i < commands_.size());
-            MLOp c = commands_[i++];
-            uint32_t arg = c.arg();
-            switch (c.op()) {
-            default:
-                fprintf(stderr, "unsupported opcode: 0x%08x\n", c.word_);
-                return;
-            case kReturn.op():
-                return;
-            case kCall.op():
-                decode(out, MLPtr{arg});
-                break;
-            case kArray.op():
-                decode(out, MLPtr{i + out.randint(arg, 0)}, true);
-                return;
-            case kLiteral.op():
-                out.blob(blob_at(arg));
-                break;
-            case kRandInt.op():
-                out.integer(out.randint(commands_[i++].word_, arg));
-                break;
-            case kProbability.op():
-                if (arg < out.randint(0x10000)) return;
-                break;
-            }
-        } while (!single);
+            : Generator(pack.storage, pack.headers, pack.commands, pack.entry) {
+#if defined(DEFL8BIT_PROFILE)
+        sites_ = pack.sites;
+#endif
+    }
+
+    // Deepest nesting of kCall a grammar may use; decode() skips calls
+    // past it.  Tail calls (kJump) don't count.
+    static constexpr int kMaxDepth = 256;
+
+    // Where a budgeted decode() stopped: the next command and the return
+    // stack, which is all the interpreter's state between commands.
+    struct Cursor {
+        uint32_t stack[kMaxDepth];
+        int sp = 0;
+        uint32_t i = 0;
+        bool started = false;
+    };
+
+    void decode(T& out, MLPtr p) const {
+        Cursor cursor;
+        cursor.i = p.address;
+        Profile::call(0);
+        run<false>(out, cursor, 0);
+    }
+
+    // One expansion of the entry point, in as many calls as it takes:
+    // each carries on from where the last stopped, and stops once
+    // out.size() has reached budget, returning false, or at the end,
+    // returning true.  Every call runs at least one command, and stops
+    // only between commands and outside any cached subtree (whose
+    // encoder state refers to the current buffer), so the caller may
+    // flush and reset() out in between.  The output is the same however
+    // it is divided up.
+    bool decode(T& out, Cursor& cursor, size_t budget) const {
+        if (!cursor.started) {
+            cursor.sp = 0;
+            cursor.i = entrypoint_.address;
+            cursor.started = true;
+            Profile::call(0);
+        }
+        bool done = run<true>(out, cursor, budget);
+        cursor.started = !done;
+        return done;
+    }
+
+   private:
+    // Direct-threaded: every handler fetches the next command and jumps
+    // straight to its handler, and calls push onto a fixed return stack
+    // rather than recursing.  A pick jumps to its chosen entry, which
+    // GenBuilder has made self-terminating (kLiteralReturn or kJump).
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#if defined(__clang__)
+#pragma clang diagnostic ignored "-Wgnu-label-as-value"
+#endif
+    template <bool kBudget>
+    bool run(T& out, Cursor& cursor, size_t budget) const {
+        static void* const kHandlers[] = {
+            &&literal_pick, &&subtree_end, &&subtree, &&alias, &&literal_array, &&literal_return,
+            &&jump, &&probability, &&rand_int, &&literal, &&array, &&ret, &&call, &&bad,
+        };
+        uint32_t* const stack = cursor.stack;
+        int sp = cursor.sp;
+        // Open kSubtree expansions; one is only ever open across a call,
+        // or the one call skipped at the depth limit.
+        typename T::SubtreeMark marks[kMaxDepth + 1];
+        int mp = 0;
+        uint32_t i = cursor.i;
+        MLOp c;
+
+#define ML_DISPATCH()                               \
+        do {                                        \
+            assert(i < commands_.size());           \
+            Profile::op(i);                         \
+            c = commands_[i++];                     \
+            goto *kHandlers[handler(c)];            \
+        } while (0)
+#define ML_NEXT()                                   \
+        do {                                        \
+            if constexpr (kBudget) {                \
+                if (out.size() >= budget && mp == 0) { \
+                    cursor.sp = sp;                 \
+                    cursor.i = i;                   \
+                    return false;                   \
+                }                                   \
+            }                                       \
+            ML_DISPATCH();                          \
+        } while (0)
+#define ML_RETURN()                                 \
+        do {                                        \
+            if (sp == 0) return true;               \
+            i = stack[--sp];                        \
+            ML_NEXT();                              \
+        } while (0)
+
+        ML_DISPATCH();
+    call:
+        // Only a recursive grammar gets this deep, and it can't be
+        // bounded ahead of time, so a call past the limit is dropped:
+        // that production is cut short rather than overrunning the stack.
+        if (sp == kMaxDepth) [[unlikely]] ML_NEXT();
+        stack[sp++] = i;
+        Profile::call(sp);
+        i = c.arg();
+        ML_NEXT();
+    jump:
+        i = c.arg();
+        ML_NEXT();
+    ret:
+        ML_RETURN();
+    array:
+        i += out.randint(c.arg(), 0);
+        ML_NEXT();
+    literal:
+        out.blob(blob_at(c.arg()));
+        ML_NEXT();
+    literal_return:
+        out.blob(blob_at(c.arg()));
+        ML_RETURN();
+    alias:
+        i += c.arg() + alias_pick(commands_.subspan(i, c.arg()), out.randint(c.arg() << 16, 0));
+        ML_NEXT();
+    literal_array:
+        out.blob(blob_at(commands_[i + out.randint(c.arg(), 0)].arg()));
+        ML_RETURN();
+    rand_int:
+        out.integer(out.randint(commands_[i++].word_, c.arg()));
+        ML_NEXT();
+    literal_pick:
+        assert(c.arg() > 0);
+        out.blob(blob_at(commands_[i + out.randint(c.arg(), 0)].arg()));
+        i += c.arg();
+        ML_NEXT();
+    probability:
+        if (c.arg() < out.randint(0x10000)) ML_RETURN();
+        ML_NEXT();
+    subtree:
+        marks[mp++] = out.subtree_begin();
+        ML_NEXT();
+    subtree_end:
+        out.subtree_end(marks[--mp], c.arg());
+        ML_RETURN();
+    bad:
+        fprintf(stderr, "unsupported opcode: 0x%08x\n", c.word_);
+        return true;
+
+#undef ML_RETURN
+#undef ML_NEXT
+#undef ML_DISPATCH
     }
+#pragma GCC diagnostic pop
+
+   public:
     void decode(T& out) const {
         decode(out, entrypoint_);
     }
 
+    // Summarise this thread's Profile::counters against this grammar.
+    // Productions are numbered in the order GenBuilder created them, which
+    // is the order of the pick() and operator() calls that built it (inner
+    // calls first), and shown with the file and line of that call where
+    // it's known.  Literal text is only legible for RawData.
+    void report(FILE* out) const {
+        auto const& counters = Profile::counters;
+        auto count = [](std::vector<uint64_t> const& v, size_t i) -> uint64_t {
+            return i < v.size() ? v[i] : 0;
+        };
+        auto label = [this](LPIndex i) {
+            std::string s;
+            for (uint8_t c : blob_at(i).literal.first(std::min<size_t>(32, headers_[i].literal_length))) {
+                if (c == '\n') s += "\\n";
+                else s += char(c);
+            }
+            return s;
+        };
+
+        uint64_t blobs = counters.blob_hits + counters.blob_misses;
+        fprintf(out, "blobs: %llu, %.1f%% backrefs (%.1f%% joined to the last), mean distance %.1f\n",
+                (unsigned long long)blobs,
+                blobs ? 100.0 * counters.blob_hits / blobs : 0.0,
+                blobs ? 100.0 * counters.blob_coalesced / blobs : 0.0,
+                counters.blob_hits ? double(counters.hit_distance) / counters.blob_hits : 0.0);
+        if (counters.subtree_hits + counters.subtree_misses > 0) {
+            fprintf(out, "subtrees: %llu matched, %llu not, %llu bytes saved\n",
+                    (unsigned long long)counters.subtree_hits,
+                    (unsigned long long)counters.subtree_misses,
+                    (unsigned long long)counters.subtree_saved);
+        }
+        fprintf(out, "calls by stack depth:");
+        for (size_t d = 0; d < counters.depth_hist.size(); ++d) {
+            if (counters.depth_hist[d]) fprintf(out, " %zu:%llu", d, (unsigned long long)counters.depth_hist[d]);
+        }
+        fprintf(out, "\n");
+
+        struct Production {
+            uint32_t start, end;
+            bool pick;
+            uint64_t ops;
+            int literal;
+        };
+        std::vector<Production> productions;
+        for (uint32_t i = 0; i < commands_.size();) {
+            uint32_t op = commands_[i].op();
+            Production p{i, i, op == kArray.op() || op == kLiteralArray.op() || op == kAlias.op(), 0, -1};
+            if (p.pick) {
+                i += 1 + commands_[i].arg() * (op == kAlias.op() ? 2 : 1);
+            } else {
+                while (i < commands_.size()) {
+                    MLOp c = commands_[i++];
+                    if (c.op() == kRandInt.op()) i++;
+                    if (c.op() == kLiteralPick.op()) i += c.arg();
+                    if (c.op() == kReturn.op() || c.op() == kJump.op()
+                        || c.op() == kLiteralReturn.op() || c.op() == kSubtreeEnd.op()) break;
+                }
+            }
+            p.end = i;
+            for (uint32_t a = p.start; a < p.end; ++a) {
+                p.ops += count(counters.ops, a);
+                if (p.literal < 0 && (commands_[a].op() == kLiteral.op()
+                                      || commands_[a].op() == kLiteralReturn.op())) {
+                    p.literal = commands_[a].arg();
+                }
+            }
+            productions.push_back(p);
+        }
+        std::vector<size_t> order(productions.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return productions[a].ops > productions[b].ops;
+        });
+        auto site = [this](uint32_t address) {
+            std::string s;
+#if defined(DEFL8BIT_PROFILE)
+            if (address < sites_.size() && sites_[address].file != nullptr) {
+                std::string_view file = sites_[address].file;
+                file.remove_prefix(file.rfind('/') + 1);
+                s = std::string(file) + ":" + integer_text(sites_[address].line);
+            }
+#endif
+            return s;
+        };
+        fprintf(out, "%5s %4s %6s %12s %12s  %-16s %s\n", "#", "kind", "addr", "calls", "ops",
+                "made at", "first literal");
+        for (size_t k : order) {
+            auto const& p = productions[k];
+            if (p.ops == 0) break;
+            fprintf(out, "%5zu %4s %6u %12llu %12llu  %-16s \"%s\"\n", k,
+                    p.pick ? "pick" : "seq", p.start,
+                    (unsigned long long)count(counters.ops, p.start),
+                    (unsigned long long)p.ops,
+                    site(p.start).c_str(),
+                    p.literal >= 0 ? label(p.literal).c_str() : "");
+        }
+
+        std::vector<LPIndex> literals(headers_.size());
+        std::iota(literals.begin(), literals.end(), 0);
+        auto bytes = [&](LPIndex i) {
+            return count(counters.literal_bytes, i) + count(counters.backref_bytes, i);
+        };
+        std::stable_sort(literals.begin(), literals.end(), [&](LPIndex a, LPIndex b) {
+            return bytes(a) > bytes(b);
+        });
+        fprintf(out, "%5s %12s %12s  %s\n", "lit", "as literal", "as backref", "text");
+        for (LPIndex i : literals) {
+            if (bytes(i) == 0) break;
+            fprintf(out, "%5u %12llu %12llu  \"%s\"\n", i,
+                    (unsigned long long)count(counters.literal_bytes, i),
+                    (unsigned long long)count(counters.backref_bytes, i),
+                    label(i).c_str());
+        }
+    }
+
     std::span<const uint8_t> storage_;
     std::span<const LiteralHeader> headers_;
     std::span<const MLOp> commands_;
     MLPtr entrypoint_;
+#if defined(DEFL8BIT_PROFILE)
+    std::span<const Site> sites_;  // empty unless made from a GenBuilder pack
+#endif
+};
+
+
+template <typename A>
+inline constexpr bool is_weighted = false;
+template <typename A>
+inline constexpr bool is_weighted<Weighted<A>> = true;
+template <typename A>
+constexpr A const& entry_of(A const& a) { return a; }
+template <typename A>
+constexpr A const& entry_of(Weighted<A> const& a) { return a.entry; }
+template <typename A>
+constexpr uint32_t weight_of(A const&) { return 1; }
+template <typename A>
+constexpr uint32_t weight_of(Weighted<A> const& a) { return a.weight; }
+template <typename A>
+using Entry = std::remove_cvref_t<decltype(entry_of(std::declval<A>()))>;
+
+// Vose's construction of a kAlias table, in integers: column k holds
+// height[k] * n out of a column height of the total weight, topped up from
+// the alias column.  `height` comes in holding the weights, and
+// `worklist` is scratch of the same size.
+template <typename V, typename Heights, typename Indices>
+constexpr void append_alias_table(V& commands, Heights height, Indices& worklist) {
+    size_t n = height.size();
+    uint64_t total = 0;
+    for (uint64_t w : height) total += w;
+    assert(total > 0);
+    // Small columns stack up from the front of the worklist, large ones
+    // from the back.
+    size_t smalls = 0, larges = n;
+    for (size_t k = 0; k < n; ++k) {
+        height[k] *= n;
+        worklist[height[k] < total ? smalls++ : --larges] = k;
+    }
+    size_t table = commands.size();
+    for (size_t k = 0; k < n; ++k) {
+        commands.push_back(MLOp{uint32_t(k << 16)});
+    }
+    while (smalls > 0 && larges < n) {
+        uint32_t s = worklist[--smalls];
+        uint32_t l = worklist[larges];
+        commands[table + s] = MLOp{(l << 16) | uint32_t((height[s] << 16) / total)};
+        height[l] -= total - height[s];
+        if (height[l] < total) {
+            larges++;
+            worklist[smalls++] = l;
+        }
+    }
+}
+
+// The form of a command which also ends its production.
+constexpr MLOp tail(MLOp c) {
+    if (c.op() == kLiteral.op()) return kLiteralReturn.arg(c.arg());
+    if (c.op() == kCall.op()) return kJump.arg(c.arg());
+    return c;
+}
+
+// The first argument of a GenBuilder call, which also carries where the
+// call was made (a defaulted std::source_location can't follow a pack).
+// An Item is anything operator() takes; a Choice anything pick() does.
+struct Item {
+    enum Kind { kText, kCall, kRange, kOp };
+    Kind kind;
+    std::string_view text{};
+    MLPtr call{};
+    RandInt range{};
+    MLOp op{};
+    std::source_location where;
+
+    template <typename A>
+        requires std::is_convertible_v<A, std::string_view>
+    constexpr Item(A const& a, std::source_location where = std::source_location::current())
+            : kind(kText), text(a), where(where) {}
+    constexpr Item(MLPtr p, std::source_location where = std::source_location::current())
+            : kind(kCall), call(p), where(where) {}
+    constexpr Item(RandInt r, std::source_location where = std::source_location::current())
+            : kind(kRange), range(r), where(where) {}
+    constexpr Item(MLOp c, std::source_location where = std::source_location::current())
+            : kind(kOp), op(c), where(where) {}
 };
 
+struct Choice {
+    Item entry;
+    uint32_t weight = 1;
+    bool weighted = false;
+
+    template <typename A>
+        requires std::is_convertible_v<A, std::string_view>
+    constexpr Choice(A const& a, std::source_location where = std::source_location::current())
+            : entry(a, where) {}
+    constexpr Choice(MLPtr p, std::source_location where = std::source_location::current())
+            : entry(p, where) {}
+    template <typename A>
+    constexpr Choice(Weighted<A> const& w,
+                     std::source_location where = std::source_location::current())
+            : entry(Choice(w.entry, where).entry), weight(w.weight), weighted(true) {}
+};
 
 template <typename T, size_t PoolSize = 65536, size_t MaxHeaders = 8192, size_t MaxCommands = 8192>
 struct GenBuilder {
@@ -117,18 +537,26 @@ struct GenBuilder {
     friend struct GenBuilder;
 
     using LiteralHeader = Generator<T>::LiteralHeader;
+    // A repeat of an earlier literal shares it.  Compared encoded, so this
+    // works whatever T's checksum (NullChecksum's is always zero).
     constexpr LPIndex add_string(std::string_view s) {
+        LPIndex r = LPIndex(headers_.size());
+        headers_.emplace_back(s, storage_);
         if (std::is_constant_evaluated()) {
-            // TODO: only works for gzip right now
-            uint32_t checksum = CRC32::check(0, s);
-            for (size_t i = 0; i < headers_.size(); ++i) {
-                if (headers_[i].literal_length == s.size() && headers_[i].checksum == checksum) {
+            auto const& h = headers_.back();
+            auto encoded = [this](LiteralHeader const& h) {
+                auto begin = storage_.begin() + h.literal_offset;
+                return std::span(begin, begin + h.literal_length);
+            };
+            for (size_t i = 0; i < r; ++i) {
+                if (headers_[i].length == h.length && headers_[i].checksum == h.checksum
+                    && std::ranges::equal(encoded(headers_[i]), encoded(h))) {
+                    pop_back();
                     return LPIndex(i);
                 }
             }
         }
-        LPIndex r = LPIndex(headers_.size());
-        headers_.emplace_back(s, storage_);
+        for (uint8_t c : s) histogram_[c]++;
         return r;
     }
     constexpr void pop_back() {
@@ -143,22 +571,88 @@ struct GenBuilder {
             : storage_{other.storage_},
               headers_{other.headers_},
               commands_{other.commands_},
-              entrypoint_{other.entrypoint_} {}
+              entrypoint_{other.entrypoint_},
+              histogram_{other.histogram_},
+              subtree_slots_{other.subtree_slots_}
+#if defined(DEFL8BIT_PROFILE)
+              , sites_{other.sites_}
+#endif
+              {}
 
+    // A trailing literal or call is fused with the return.
     template <typename... Args>
-    constexpr MLPtr operator()(Args... args) {
+    constexpr MLPtr operator()(Item first, Args... args) {
         MLPtr result = next_op();
+        note(result, first.where);
+        ingest_item(first);
         ( ingest(args), ... );
+        bool fused;
+        if constexpr (sizeof...(Args) > 0) {
+            using Last = std::tuple_element_t<sizeof...(Args) - 1, std::tuple<Args...>>;
+            fused = std::is_same_v<Last, MLPtr> || std::is_convertible_v<Last, std::string_view>;
+        } else {
+            fused = first.kind == Item::kText || first.kind == Item::kCall;
+        }
+        if (fused) {
+            commands_.back() = tail(commands_.back());
+        } else {
+            commands_.emplace_back(kReturn);
+        }
+        return result;
+    }
+    constexpr MLPtr operator()(std::source_location where = std::source_location::current()) {
+        MLPtr result = next_op();
+        note(result, where);
         commands_.emplace_back(kReturn);
         return result;
     }
 
+    // Each entry is a single command which ends the production when run.
+    // Any entry wrapped in ML::weight() makes this a weighted pick, in
+    // which unwrapped entries have weight 1.
     template <typename... Args>
-    constexpr MLPtr pick(Args... args) {
-        constexpr uint32_t len = sizeof...(args);
+    constexpr MLPtr pick(Choice first, Args... args) {
+        static_assert(((std::is_same_v<Entry<Args>, MLPtr>
+                        || std::is_convertible_v<Entry<Args>, std::string_view>) && ...),
+                      "pick() entries must be literals or productions");
+        constexpr uint32_t len = 1 + sizeof...(args);
+        bool literals = first.entry.kind == Item::kText
+                        && (std::is_convertible_v<Entry<Args>, std::string_view> && ...);
+        bool weighted = first.weighted || (is_weighted<Args> || ...);
+        static_assert(len <= 0xffff || !(is_weighted<Args> || ...), "too many weighted entries");
+        assert(!weighted || len <= 0xffff);
         MLPtr result = next_op();
-        commands_.emplace_back(kArray.arg(len));
-        ( ingest(args), ... );
+        note(result, first.entry.where);
+        uint32_t entries = result.address + 1;
+        if (weighted) {
+            commands_.emplace_back(kAlias.arg(len));
+            std::array<uint32_t, len> worklist;
+            append_alias_table(commands_, std::array<uint64_t, len>{first.weight, weight_of(args)...},
+                               worklist);
+            entries += len;
+        } else {
+            commands_.emplace_back((literals ? kLiteralArray : kArray).arg(len));
+        }
+        ingest_item(first.entry);
+        ( ingest(entry_of(args)), ... );
+        for (uint32_t i = 0; i < len; ++i) {
+            auto& c = commands_[entries + i];
+            c = tail(c);
+        }
+        return result;
+    }
+
+    // A production which expands p, through the encoder's subtree cache:
+    // an expansion that repeats one within the window (the same choices
+    // all the way down) goes out as a single backref.  Worth it where p
+    // is several blobs long but takes few enough choices to repeat often.
+    constexpr MLPtr cached(MLPtr p, std::source_location where = std::source_location::current()) {
+        MLPtr result = next_op();
+        note(result, where);
+        commands_.emplace_back(kSubtree.arg(subtree_slots_));
+        commands_.emplace_back(kCall.arg(p.address));
+        commands_.emplace_back(kSubtreeEnd.arg(subtree_slots_));
+        subtree_slots_++;
         return result;
     }
 
@@ -166,6 +660,12 @@ struct GenBuilder {
         entrypoint_ = entry;
     }
 
+    // Bytes of literal text, counting each distinct literal once; see
+    // Defl8bitFittedLengths.
+    constexpr std::array<uint32_t, 256> const& histogram() const {
+        return histogram_;
+    }
+
     constexpr auto sizes() const {
         return std::array{
             storage_.size(),
@@ -181,6 +681,9 @@ struct GenBuilder {
         std::copy(headers_.begin(), headers_.end(), r.headers.begin());
         std::copy(commands_.begin(), commands_.end(), r.commands.begin());
         r.entry = entrypoint_;
+#if defined(DEFL8BIT_PROFILE)
+        std::copy(sites_.begin(), sites_.end(), r.sites.begin());
+#endif
         return r;
     }
 
@@ -197,7 +700,35 @@ struct GenBuilder {
     constexpr void ingest(MLOp op) {
         commands_.emplace_back(op);
     }
+    constexpr void ingest_item(Item const& item) {
+        switch (item.kind) {
+        case Item::kText: return ingest(item.text);
+        case Item::kCall: return ingest(item.call);
+        case Item::kRange: return ingest(item.range);
+        case Item::kOp: return ingest(item.op);
+        }
+    }
+    // Record where the production at p was asked for.
+    constexpr void note([[maybe_unused]] MLPtr p, [[maybe_unused]] std::source_location where) {
+#if defined(DEFL8BIT_PROFILE)
+        if (sites_.size() <= p.address) sites_.resize(p.address + 1);
+        sites_[p.address] = Site{where.file_name(), uint32_t(where.line())};
+#endif
+    }
     constexpr void ingest(RandInt r) {
+        // A single value is just its text; an empty range stays a
+        // kRandInt, which gives lo.
+        if (r.hi - r.lo == 1) {
+            ingest(std::string_view(integer_text(r.lo)));
+            return;
+        }
+        if (r.hi > r.lo && r.hi - r.lo <= max_literal_pick<T>()) {
+            commands_.emplace_back(kLiteralPick.arg(r.hi - r.lo));
+            for (uint32_t n = r.lo; n < r.hi; ++n) {
+                commands_.emplace_back(kLiteral.arg(add_string(integer_text(n))));
+            }
+            return;
+        }
         commands_.emplace_back(kRandInt.arg(r.lo));
         commands_.emplace_back(r.hi - r.lo);
     }
@@ -207,6 +738,11 @@ struct GenBuilder {
     inplace_vector<LiteralHeader, MaxHeaders> headers_;
     inplace_vector<MLOp, MaxCommands> commands_;
     MLPtr entrypoint_;
+    std::array<uint32_t, 256> histogram_{};
+    uint32_t subtree_slots_ = 0;
+#if defined(DEFL8BIT_PROFILE)
+    inplace_vector<Site, MaxCommands> sites_;  // by address of each production
+#endif
 };
 
 }  // namespace detail
@@ -0,0 +1,40 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include "catfacts.h"
+#include "grammar.h"
+#include "packfile.h"
+
+// Writes a grammar (the built-in one, or one loaded from a text file) as a
+// pack file for `demo -g`.
+int main(int argc, char * const* argv) {
+    char const* output = "grammar.pack";
+    int opt;
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+        case 'o': output = optarg;
+            break;
+        default: fprintf(stderr, "Usage: %s [-o output] [grammar]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind > 1) {
+        fprintf(stderr, "Unexpected leftover arguments.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (optind == argc) {
+        write_pack(output, catfacts.generic_gzip_catfacts_, catfacts.raw_catfacts_,
+                   catfacts.gzip4_catfacts_, catfacts.zlib_catfacts_);
+    } else {
+        auto gzip = ML::Grammar<GZip>::load(argv[optind]);
+        auto raw = ML::Grammar<RawData>::load(argv[optind]);
+        auto gzip4 = ML::Grammar<GZip4>::load(argv[optind]);
+        auto zlib = ML::Grammar<ZLib>::load(argv[optind]);
+        write_pack(output, gzip.generator(), raw.generator(), gzip4.generator(),
+                   zlib.generator());
+    }
+    return 0;
+}
@@ -0,0 +1,255 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "packfile.h"
+
+using namespace PackFormat;
+
+namespace {
+
+[[noreturn]] void reject(char const* path, char const* why) {
+    fprintf(stderr, "%s: %s\n", path, why);
+    exit(EXIT_FAILURE);
+}
+
+size_t align16(size_t n) {
+    return (n + 15) & ~size_t(15);
+}
+
+uint32_t body_checksum(std::span<uint8_t const> file) {
+    return CRC32::check(0, file.subspan(sizeof(PackFileHeader)));
+}
+
+// Whether commands are laid out as GenBuilder and Grammar make them,
+// since the interpreter trusts them completely.  A production is either a
+// pick, whose entries each end it, or a run of commands ending in a
+// return; every literal index must be in the headers, and every call or
+// jump must land on the start of a production.
+bool valid_commands(std::span<ML::detail::MLOp const> commands, uint64_t headers,
+                    uint32_t entry) {
+    using namespace ML::detail;
+    size_t n = commands.size();
+    std::vector<bool> starts(n);
+    std::vector<uint32_t> targets{entry};
+    auto literal = [&](MLOp c) { return c.arg() < headers; };
+
+    for (size_t i = 0; i < n;) {
+        starts[i] = true;
+        MLOp c = commands[i++];
+        uint32_t op = c.op();
+        if (op == kArray.op() || op == kLiteralArray.op() || op == kAlias.op()) {
+            uint32_t len = c.arg();
+            if (len == 0 || len > n - i) return false;
+            if (op == kAlias.op()) {
+                if (len > 0xffff || len > (n - i) / 2) return false;
+                for (uint32_t k = 0; k < len; ++k) {
+                    if (commands[i++].word_ >> 16 >= len) return false;
+                }
+            }
+            for (uint32_t k = 0; k < len; ++k) {
+                MLOp e = commands[i++];
+                if (e.op() == kLiteralReturn.op()) {
+                    if (!literal(e)) return false;
+                } else if (e.op() == kJump.op() && op != kLiteralArray.op()) {
+                    targets.push_back(e.arg());
+                } else {
+                    return false;
+                }
+            }
+            continue;
+        }
+        for (;;) {
+            if (op == kReturn.op()) break;
+            if (op == kLiteralReturn.op()) {
+                if (!literal(c)) return false;
+                break;
+            }
+            if (op == kJump.op()) {
+                targets.push_back(c.arg());
+                break;
+            }
+            if (op == kSubtree.op()) {
+                // Always the whole of a production: the call, then the
+                // end of the same slot, which returns.
+                if (n - i < 2 || commands[i].op() != kCall.op()
+                    || commands[i + 1].word_ != kSubtreeEnd.arg(c.arg()).word_
+                    || c.arg() >= n) {
+                    return false;
+                }
+                targets.push_back(commands[i].arg());
+                i += 2;
+                break;
+            }
+            if (op == kCall.op()) {
+                targets.push_back(c.arg());
+            } else if (op == kLiteral.op()) {
+                if (!literal(c)) return false;
+            } else if (op == kRandInt.op()) {
+                if (i == n) return false;
+                i++;  // the range
+            } else if (op == kLiteralPick.op()) {
+                uint32_t len = c.arg();
+                if (len == 0 || len > n - i) return false;
+                for (uint32_t k = 0; k < len; ++k) {
+                    MLOp e = commands[i++];
+                    if (e.op() != kLiteral.op() || !literal(e)) return false;
+                }
+            } else if (op != kProbability.op()) {
+                return false;
+            }
+            if (i == n) return false;
+            c = commands[i++];
+            op = c.op();
+        }
+    }
+    for (uint32_t t : targets) {
+        if (t >= n || !starts[t]) return false;
+    }
+    return true;
+}
+
+template <typename T>
+void append(std::vector<uint8_t>& out, std::span<T const> data) {
+    auto bytes = std::as_bytes(data);
+    out.resize(align16(out.size()));
+    out.insert(out.end(), reinterpret_cast<uint8_t const*>(bytes.data()),
+               reinterpret_cast<uint8_t const*>(bytes.data()) + bytes.size());
+}
+
+template <typename T>
+PackSection add_section(std::vector<uint8_t>& out, ML::Generator<T> const& gen) {
+    PackSection s{};
+    s.encoder = kEncoder<T>;
+    s.fingerprint = fingerprint<T>();
+    s.entry = gen.entrypoint_.address;
+    s.storage_offset = align16(out.size());
+    s.storage_size = gen.storage_.size();
+    append(out, gen.storage_);
+    s.headers_offset = align16(out.size());
+    s.headers_count = gen.headers_.size();
+    append(out, gen.headers_);
+    s.commands_offset = align16(out.size());
+    s.commands_count = gen.commands_.size();
+    append(out, gen.commands_);
+    return s;
+}
+
+}  // namespace
+
+PackFile::PackFile(char const* path) : path_(path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (size_t(st.st_size) < sizeof(PackFileHeader)) reject(path, "not a pack file");
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    data_ = std::span(static_cast<uint8_t const*>(p), st.st_size);
+
+    auto const& header = *reinterpret_cast<PackFileHeader const*>(data_.data());
+    if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) reject(path, "not a pack file");
+    if (header.version != kVersion) reject(path, "unsupported pack version");
+    if (header.file_size != data_.size()) reject(path, "pack file truncated");
+    if (header.sections > (data_.size() - sizeof(header)) / sizeof(PackSection)) {
+        reject(path, "pack file corrupt");
+    }
+    if (header.checksum != body_checksum(data_)) reject(path, "pack file checksum mismatch");
+
+    // Everything the generators will index, checked once here rather
+    // than on every command.
+    auto fits = [&](uint64_t offset, uint64_t count, size_t size) {
+        return offset % 16 == 0 && offset <= data_.size()
+               && count <= (data_.size() - offset) / size;
+    };
+    using LiteralHeader = ML::Generator<GZip>::LiteralHeader;
+    auto sections = reinterpret_cast<PackSection const*>(data_.data() + sizeof(header));
+    for (uint32_t k = 0; k < header.sections; ++k) {
+        auto const& s = sections[k];
+        if (!fits(s.storage_offset, s.storage_size, 1)
+            || !fits(s.headers_offset, s.headers_count, sizeof(LiteralHeader))
+            || !fits(s.commands_offset, s.commands_count, sizeof(ML::detail::MLOp))
+            || s.entry >= s.commands_count) {
+            reject(path, "pack file corrupt");
+        }
+        auto headers = reinterpret_cast<LiteralHeader const*>(data_.data() + s.headers_offset);
+        for (uint64_t i = 0; i < s.headers_count; ++i) {
+            if (uint64_t(headers[i].literal_offset) + headers[i].literal_length > s.storage_size) {
+                reject(path, "pack file corrupt");
+            }
+        }
+        auto commands = std::span(
+                reinterpret_cast<ML::detail::MLOp const*>(data_.data() + s.commands_offset),
+                s.commands_count);
+        if (!valid_commands(commands, s.headers_count, s.entry)) {
+            reject(path, "pack file commands corrupt");
+        }
+    }
+}
+
+PackFile::~PackFile() {
+    munmap(const_cast<uint8_t*>(data_.data()), data_.size());
+}
+
+bool PackFile::is_pack(char const* path) {
+    char magic[sizeof(kMagic)];
+    FILE* f = fopen(path, "rb");
+    if (f == nullptr) return false;
+    bool r = fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+             && memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+    fclose(f);
+    return r;
+}
+
+PackSection const& PackFile::section(uint32_t encoder, uint32_t fingerprint) const {
+    auto const& header = *reinterpret_cast<PackFileHeader const*>(data_.data());
+    auto sections = reinterpret_cast<PackSection const*>(data_.data() + sizeof(header));
+    for (uint32_t i = 0; i < header.sections; ++i) {
+        auto const& s = sections[i];
+        if (s.encoder != encoder) continue;
+        if (s.fingerprint != fingerprint) reject(path_, "pack made for different encoder tables");
+        return s;
+    }
+    reject(path_, "pack has no section for this encoder");
+}
+
+void write_pack(char const* path, ML::Generator<GZip> const& gzip,
+                ML::Generator<RawData> const& raw, ML::Generator<GZip4> const& gzip4,
+                ML::Generator<ZLib> const& zlib) {
+    constexpr uint32_t kSections = 4;
+    std::vector<uint8_t> out(sizeof(PackFileHeader) + kSections * sizeof(PackSection));
+    PackSection sections[kSections] = {
+        add_section(out, gzip),
+        add_section(out, raw),
+        add_section(out, gzip4),
+        add_section(out, zlib),
+    };
+    memcpy(out.data() + sizeof(PackFileHeader), sections, sizeof(sections));
+
+    PackFileHeader header{};
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.sections = kSections;
+    header.file_size = out.size();
+    memcpy(out.data(), &header, sizeof(header));
+    header.checksum = body_checksum(out);
+    memcpy(out.data(), &header, sizeof(header));
+
+    FILE* f = fopen(path, "wb");
+    if (f == nullptr || fwrite(out.data(), 1, out.size(), f) != out.size() || fclose(f) != 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+}
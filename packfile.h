@@ -0,0 +1,123 @@
+#if !defined(PACKFILE_H_INCLUDED)
+#define PACKFILE_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "checksum.h"
+#include "defl8bit.h"
+#include "ml.h"
+
+// A grammar's tables in a file, for mapping straight into memory.  One
+// file holds a section per encoder type, since the literal storage is
+// pre-encoded for that encoder.  Every section is 16-byte aligned, and all
+// fields are native-endian.
+//
+//     PackFileHeader
+//     PackSection[sections]
+//     storage, headers and commands for each section
+//
+// The header checksum (CRC32) covers everything after the header, and each
+// section records a fingerprint of its encoder's literal encoding, so a
+// pack made with different Huffman tables is rejected rather than
+// producing a corrupt stream.
+namespace PackFormat {
+
+inline constexpr char kMagic[8] = {'D', 'F', 'L', '8', 'P', 'A', 'C', 'K'};
+inline constexpr uint32_t kVersion = 3;
+
+enum Encoder : uint32_t {
+    kGZip = 1,
+    kRawData = 2,
+    kGZip4 = 3,
+    kZLib = 4,
+};
+
+struct PackFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sections;
+    uint64_t file_size;
+    uint32_t checksum;
+    uint32_t reserved;
+};
+
+struct PackSection {
+    uint32_t encoder;
+    uint32_t fingerprint;
+    uint32_t entry;
+    uint32_t reserved;
+    uint64_t storage_offset, storage_size;
+    uint64_t headers_offset, headers_count;
+    uint64_t commands_offset, commands_count;
+};
+
+template <typename T>
+inline constexpr Encoder kEncoder = std::is_same_v<T, GZip>    ? kGZip
+                                    : std::is_same_v<T, GZip4> ? kGZip4
+                                    : std::is_same_v<T, ZLib>  ? kZLib
+                                                               : kRawData;
+
+// Changes whenever T would encode literals differently, or the layout of
+// the tables changes.
+template <typename T>
+uint32_t fingerprint() {
+    using LiteralHeader = typename ML::Generator<T>::LiteralHeader;
+    std::string probe = "\n";
+    for (char c = ' '; c <= '~'; ++c) probe += c;
+    probe += "é€\U0001f408";
+    std::vector<uint8_t> storage;
+    uint32_t check = T::encode_literal(storage, probe);
+    check = CRC32::check(check, storage);
+    uint32_t sizes[] = {sizeof(LiteralHeader), sizeof(ML::detail::MLOp), kVersion};
+    return CRC32::check(check, std::span(reinterpret_cast<uint8_t const*>(sizes), sizeof(sizes)));
+}
+
+}  // namespace PackFormat
+
+// A pack file mapped read-only.  The generators it hands out point into
+// the mapping, so they are only valid while it stays open; pages are
+// shared between every process which maps the same file.
+//
+// Errors are reported on stderr, and are fatal.
+class PackFile {
+   public:
+    explicit PackFile(char const* path);
+    ~PackFile();
+    PackFile(PackFile const&) = delete;
+    PackFile& operator=(PackFile const&) = delete;
+
+    // Whether the file at path looks like a pack rather than anything else.
+    static bool is_pack(char const* path);
+
+    template <typename T>
+    ML::Generator<T> generator() const {
+        using LiteralHeader = typename ML::Generator<T>::LiteralHeader;
+        auto const& s = section(PackFormat::kEncoder<T>, PackFormat::fingerprint<T>());
+        return ML::Generator<T>(
+                data_.subspan(s.storage_offset, s.storage_size),
+                std::span(reinterpret_cast<LiteralHeader const*>(data_.data() + s.headers_offset),
+                          s.headers_count),
+                std::span(reinterpret_cast<ML::detail::MLOp const*>(data_.data() + s.commands_offset),
+                          s.commands_count),
+                ML::MLPtr{s.entry});
+    }
+
+   private:
+    PackFormat::PackSection const& section(uint32_t encoder, uint32_t fingerprint) const;
+
+    char const* path_;
+    std::span<uint8_t const> data_;
+};
+
+// Write every encoder's tables for one grammar to path.
+void write_pack(char const* path, ML::Generator<GZip> const& gzip,
+                ML::Generator<RawData> const& raw, ML::Generator<GZip4> const& gzip4,
+                ML::Generator<ZLib> const& zlib);
+
+#endif  // !defined(PACKFILE_H_INCLUDED)
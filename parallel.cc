@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "defl8bit.h"
+#include "catfacts.h"
+#include "parallel.h"
+
+namespace {
+
+static constexpr uint64_t kSegmentLength = 0x100000;
+static constexpr size_t kBufferSafety = 0x4000;
+// Encoded text can be up to 4/3 the size of the original (three-byte UTF-8
+// sequences take 32 bits).
+static constexpr size_t kSegmentBuffer = kSegmentLength * 4 / 3 + kBufferSafety;
+
+struct Segment {
+    std::vector<uint8_t> buffer = std::vector<uint8_t>(kSegmentBuffer);
+    size_t size = 0;
+    uint32_t length = 0;
+    uint32_t checksum = 0;
+    bool ready = false;
+};
+
+// Spread consecutive segment numbers out across the seed space.
+uint64_t segment_seed(uint64_t seed, uint64_t k) {
+    uint64_t z = seed + k * UINT64_C(0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+template <typename T>
+void generate_segment(Segment& s, uint64_t seed, uint64_t target) {
+    T enc(s.buffer);
+    enc.start_segment();
+    enc.seed(seed);
+    while (std::get<0>(enc.tell()) < target) {
+        catfacts.do_something(enc);
+    }
+    enc.flush();
+    assert(enc.size() < s.buffer.size());
+    s.size = enc.size();
+    std::tie(s.length, s.checksum) = enc.tell();
+}
+
+template <typename T>
+void run(OutputSink& out, T& stream, uint64_t length, uint64_t seed, int threads) {
+    const uint64_t segments = std::max<uint64_t>(1, (length + kSegmentLength - 1) / kSegmentLength);
+    // Two slots per thread, so each can start on its next segment while the
+    // previous one waits to be written.
+    const size_t slots = 2 * threads;
+    std::vector<Segment> ring(slots);
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint64_t consumed = 0;
+
+    auto worker = [&](int t) {
+        for (uint64_t k = t; k < segments; k += threads) {
+            Segment& s = ring[k % slots];
+            {
+                std::unique_lock lock(mutex);
+                cv.wait(lock, [&]() { return k < consumed + slots; });
+            }
+            uint64_t target = std::min(kSegmentLength, length - k * kSegmentLength);
+            generate_segment<T>(s, segment_seed(seed, k), target);
+            {
+                std::lock_guard lock(mutex);
+                s.ready = true;
+            }
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t) pool.emplace_back(worker, t);
+
+    for (uint64_t k = 0; k < segments; ++k) {
+        Segment& s = ring[k % slots];
+        {
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [&]() { return s.ready; });
+        }
+        out.write(std::span(s.buffer.data(), s.size));
+        stream.append_segment(s.length, s.checksum);
+        {
+            std::lock_guard lock(mutex);
+            s.ready = false;
+            consumed = k + 1;
+        }
+        cv.notify_all();
+    }
+    for (auto& t : pool) t.join();
+}
+
+}  // namespace
+
+void generate_parallel(OutputSink& out, bool compressed, uint64_t length,
+                       uint64_t seed, int threads) {
+    std::array<uint8_t, kBufferSafety> buffer;
+    if (compressed) {
+        CatFactsGZip gz(buffer);
+        gz.head(time(NULL));
+        out.write(std::span(gz.begin(), gz.end()));
+        gz.reset();
+        run(out, gz, length, seed, threads);
+        gz.tail();
+        out.write(std::span(gz.begin(), gz.end()));
+    } else {
+        RawData txt(buffer);
+        run(out, txt, length, seed, threads);
+    }
+}
@@ -0,0 +1,15 @@
+#if !defined(PARALLEL_H_INCLUDED)
+#define PARALLEL_H_INCLUDED
+
+#include <cstdint>
+
+#include "sink.h"
+
+// Generate at least `length` bytes of output on `threads` threads.  Every
+// symbol is byte-aligned, so independently seeded segments can be
+// concatenated into a single deflate block, with only their lengths and
+// checksums combined in order.
+void generate_parallel(OutputSink& out, bool compressed, uint64_t length,
+                       uint64_t seed, int threads);
+
+#endif  // !defined(PARALLEL_H_INCLUDED)
@@ -0,0 +1,91 @@
+#if !defined(PRNG_H_INCLUDED)
+#define PRNG_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+// Random words for EncoderBase::randint().  Both generators here mix a
+// Weyl sequence (a counter stepped by the golden ratio), so any word can
+// be computed without the ones before it: they're made kBatch at a time,
+// in vector registers, and randint() just takes the next one from the
+// buffer instead of waiting on a chain of multiplies.
+//
+// The vector type leaves the instruction choice to the compiler: one
+// vpmullq per eight words with AVX-512DQ, or the usual vpmuludq sequence
+// with AVX2.  Mixers work in place, since passing a 64-byte vector by
+// value is an ABI change (-Wpsabi) without AVX-512.
+template <typename Mix>
+class CounterPrng {
+   public:
+    static constexpr size_t kBatch = 16;
+    static constexpr uint64_t kStep = UINT64_C(0x9e3779b97f4a7c15);
+
+    CounterPrng() { seed(1); }
+
+    void seed(uint64_t seed) {
+        base_ = seed - kBatch * kStep;
+        next_ = kBatch;
+    }
+
+    // The seed which carries on from here, for a checkpoint.
+    uint64_t state() const { return base_ + next_ * kStep; }
+
+    uint64_t next() {
+        if (next_ == kBatch) refill();
+        return buffer_[next_++];
+    }
+
+   private:
+    typedef uint64_t Lanes __attribute__((vector_size(64)));
+    static constexpr size_t kLanes = sizeof(Lanes) / sizeof(uint64_t);
+    static_assert(kBatch % kLanes == 0);
+
+    // Out of line, to keep the callers' loops small; it runs once per
+    // kBatch words.
+    [[gnu::noinline]] void refill() {
+        base_ += kBatch * kStep;
+        Lanes z;
+        for (size_t i = 0; i < kLanes; ++i) z[i] = base_ + i * kStep;
+        for (size_t i = 0; i < kBatch; i += kLanes) {
+            Lanes r = z;
+            Mix::mix(r);
+            __builtin_memcpy(&buffer_[i], &r, sizeof(r));
+            z += kLanes * kStep;
+        }
+        next_ = 0;
+    }
+
+    alignas(64) uint64_t buffer_[kBatch];
+    uint64_t base_;  // the counter for buffer_[0]
+    size_t next_;
+};
+
+// splitmix64's finaliser as randint() has always used it, without the
+// last shift (randint() only takes the top half), so seeds give the same
+// output as before.
+struct SplitMix64 {
+    template <typename T>
+    static constexpr void mix(T& z) {
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    }
+};
+
+// One multiply instead of two.  Plenty for picking productions, but a
+// given seed makes different text, so it's opt-in (DEFL8BIT_FAST_PRNG,
+// `make FAST_PRNG=1`).
+struct FastMix64 {
+    template <typename T>
+    static constexpr void mix(T& z) {
+        z = (z ^ (z >> 32)) * UINT64_C(0xd6e8feb86659fd93);
+        z ^= z >> 32;
+    }
+};
+
+#if defined(DEFL8BIT_FAST_PRNG)
+using EncoderPrng = CounterPrng<FastMix64>;
+#else
+using EncoderPrng = CounterPrng<SplitMix64>;
+#endif
+
+#endif  // !defined(PRNG_H_INCLUDED)
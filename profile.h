@@ -0,0 +1,104 @@
+#if !defined(PROFILE_H_INCLUDED)
+#define PROFILE_H_INCLUDED
+
+#include <csignal>
+#include <cstdint>
+#include <vector>
+
+// Optional instrumentation of the generator and encoder, compiled in with
+// -DDEFL8BIT_PROFILE (`make PROFILE=1`).  Otherwise every hook here is an
+// empty inline function.
+//
+// Counters are per thread; a report covers the thread that produces it.
+namespace Profile {
+
+#if defined(DEFL8BIT_PROFILE)
+inline constexpr bool kEnabled = true;
+#else
+inline constexpr bool kEnabled = false;
+#endif
+
+struct Counters {
+    std::vector<uint64_t> ops;            // executions, by command address
+    std::vector<uint64_t> literal_bytes;  // by literal index, sent as literals
+    std::vector<uint64_t> backref_bytes;  // by literal index, sent as backrefs
+    std::vector<uint64_t> depth_hist;     // calls, by return stack depth
+    uint64_t blob_hits = 0;
+    uint64_t blob_misses = 0;
+    uint64_t hit_distance = 0;            // summed over hits
+    uint64_t blob_coalesced = 0;          // hits which lengthened the previous match
+    uint64_t subtree_hits = 0;
+    uint64_t subtree_misses = 0;
+    uint64_t subtree_saved = 0;           // bytes, over hits
+
+    static void bump(std::vector<uint64_t>& v, size_t i, uint64_t n = 1) {
+        if (i >= v.size()) v.resize(i + 64);
+        v[i] += n;
+    }
+};
+
+inline thread_local Counters counters;
+inline volatile std::sig_atomic_t report_requested = 0;
+
+inline void op(uint32_t address) {
+    if constexpr (kEnabled) Counters::bump(counters.ops, address);
+}
+
+inline void blob(uint32_t index, uint32_t length, bool hit, uint32_t distance) {
+    if constexpr (kEnabled) {
+        if (hit) {
+            counters.blob_hits++;
+            counters.hit_distance += distance;
+            Counters::bump(counters.backref_bytes, index, length);
+        } else {
+            counters.blob_misses++;
+            Counters::bump(counters.literal_bytes, index, length);
+        }
+    }
+}
+
+// The last blob hit, at the same distance as the one before it, so the
+// two went out as one match.
+inline void coalesce() {
+    if constexpr (kEnabled) counters.blob_coalesced++;
+}
+
+// A cached subtree's expansion closed, and was (or wasn't) replaced by a
+// backref `saved` bytes shorter.
+inline void subtree(bool hit, size_t saved) {
+    if constexpr (kEnabled) {
+        if (hit) {
+            counters.subtree_hits++;
+            counters.subtree_saved += saved;
+        } else {
+            counters.subtree_misses++;
+        }
+    }
+}
+
+// A production was entered with `depth` calls pending on the return stack.
+inline void call(int depth) {
+    if constexpr (kEnabled) Counters::bump(counters.depth_hist, depth);
+}
+
+// Install a SIGUSR1 handler which asks for a report at the next
+// convenient point (see take_request()).
+inline void report_on_signal() {
+    if constexpr (kEnabled) {
+        signal(SIGUSR1, [](int) { report_requested = 1; });
+    }
+}
+
+inline bool take_request() {
+    if constexpr (kEnabled) {
+        if (report_requested) {
+            report_requested = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace Profile
+
+#endif  // !defined(PROFILE_H_INCLUDED)
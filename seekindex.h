@@ -0,0 +1,123 @@
+#if !defined(SEEKINDEX_H_INCLUDED)
+#define SEEKINDEX_H_INCLUDED
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <span>
+#include <vector>
+
+#include "ml.h"
+#include "sink.h"
+
+// Checkpoints through one document -- `length` bytes of text or so from
+// `seed`, as the demo generates it -- every `interval` bytes of text, at
+// entry boundaries.  Any part of the document can then be regenerated
+// from the last checkpoint before it rather than from the start, and
+// separate parts independently of each other.
+//
+// Building the index generates the whole document once.  It holds only
+// what T::Checkpoint needs, which for the deflate encoders is the part of
+// their backref state still inside the 32K window.
+template <typename T>
+class SeekIndex {
+   public:
+    using Checkpoint = typename T::Checkpoint;
+
+    SeekIndex(ML::Generator<T> const& gen, uint64_t seed, uint64_t length,
+              uint64_t interval = 0x100000, time_t time = 0)
+        : gen_(gen), length_(length), time_(time) {
+        std::vector<uint8_t> buffer(kBufferLimit + kBufferSafety);
+        T enc(buffer);
+        enc.seed(seed);
+        // The first checkpoint is from before the head; generate() writes
+        // that itself.
+        checkpoints_.push_back(enc.checkpoint(0, 0));
+        if constexpr (requires { enc.head(); }) enc.head(time_);
+
+        uint64_t flushed = 0, next = interval;
+        uint32_t last = 0;
+        typename ML::Generator<T>::Cursor cursor;
+        for (uint64_t done = 0; done < length_;) {
+            if (done >= next) {
+                checkpoints_.push_back(enc.checkpoint(done, flushed + enc.size()));
+                next = done + interval;
+            }
+            bool finished;
+            do {
+                finished = gen_.decode(enc, cursor, kBufferLimit);
+                if (enc.size() >= kBufferLimit) {
+                    flushed += enc.size();
+                    enc.reset();
+                }
+            } while (!finished);
+            uint32_t position = std::get<0>(enc.tell());
+            done += uint32_t(position - last);
+            last = position;
+        }
+        if constexpr (requires { enc.tail(); }) enc.tail();
+        size_ = flushed + enc.size();
+    }
+
+    // Length of the whole document as encoded.
+    uint64_t size() const { return size_; }
+    size_t checkpoints() const { return checkpoints_.size(); }
+
+    // The last checkpoint at or before output offset `offset`.
+    Checkpoint const& before(uint64_t offset) const {
+        auto it = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), offset,
+                                   [](uint64_t x, Checkpoint const& c) { return x < c.size; });
+        return *std::prev(it);
+    }
+
+    // Write the document from output offset `begin` to the end of it,
+    // generating from the checkpoint before `begin`.
+    void generate(OutputSink& sink, uint64_t begin) const {
+        Checkpoint const& c = before(begin);
+        std::vector<uint8_t> buffer(kBufferLimit + kBufferSafety);
+        T enc(buffer);
+        enc.resume(c);
+        if (&c == &checkpoints_.front()) {
+            if constexpr (requires { enc.head(); }) enc.head(time_);
+        }
+
+        uint64_t at = c.size;  // output offset of buffer's start
+        auto write = [&]() {
+            uint64_t end = at + enc.size();
+            if (end > begin) {
+                size_t skip = begin > at ? begin - at : 0;
+                sink.write(std::span(enc.begin() + skip, enc.end()));
+            }
+            at = end;
+            enc.reset();
+        };
+        uint32_t last = c.position;
+        typename ML::Generator<T>::Cursor cursor;
+        for (uint64_t done = c.text; done < length_;) {
+            bool finished;
+            do {
+                finished = gen_.decode(enc, cursor, kBufferLimit);
+                if (enc.size() >= kBufferLimit) write();
+            } while (!finished);
+            uint32_t position = std::get<0>(enc.tell());
+            done += uint32_t(position - last);
+            last = position;
+        }
+        if constexpr (requires { enc.tail(); }) enc.tail();
+        write();
+    }
+
+   private:
+    // Entries are decoded a buffer's worth at a time, which can run one
+    // literal past the limit (see main.cc's kHeadroom).
+    static constexpr size_t kBufferLimit = 0x100000;
+    static constexpr size_t kBufferSafety = UINT16_MAX + 0x4000;
+
+    ML::Generator<T> const& gen_;
+    uint64_t length_;
+    time_t time_;
+    uint64_t size_ = 0;
+    std::vector<Checkpoint> checkpoints_;
+};
+
+#endif  // !defined(SEEKINDEX_H_INCLUDED)
@@ -0,0 +1,385 @@
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "defl8bit.h"
+#include "catfacts.h"
+#include "server.h"
+#include "timerwheel.h"
+
+namespace {
+
+static constexpr size_t kMaxRequest = 0x2000;
+static constexpr size_t kMaxEvents = 256;
+
+// The generator is only checked against the limit between entries, so
+// leave room for one whole entry past it.
+static constexpr size_t kChunkLimit = 0x4000;
+static constexpr size_t kChunkSafety = 0x4000;
+// Fixed-width "xxxx\r\n", filled in once the chunk length is known.
+static constexpr size_t kChunkHead = 6;
+static constexpr size_t kResponseRoom = 0x100;
+static constexpr size_t kBufferSize = kResponseRoom + kChunkHead
+                                    + kChunkLimit + kChunkSafety + 16;
+static_assert(kChunkLimit + kChunkSafety <= 0xffff);
+
+// Followed by kChunked, or a Content-Length line and a blank one.
+constexpr std::string_view kResponseHead =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/plain; charset=utf-8\r\n"
+    "Content-Encoding: gzip\r\n";
+constexpr std::string_view kChunked =
+    "Transfer-Encoding: chunked\r\n"
+    "\r\n";
+static constexpr size_t kMaxLengthLine = 40;  // "Content-Length: ...\r\n\r\n"
+constexpr std::string_view kNotAllowed =
+    "HTTP/1.1 405 Method Not Allowed\r\n"
+    "Allow: GET\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+static_assert(kResponseHead.size() + kMaxLengthLine <= kResponseRoom);
+
+struct Connection : TimerNode {
+    explicit Connection(int fd) : fd(fd) {}
+
+    int fd;
+    std::string request;
+    std::vector<uint8_t> buffer;  // output waiting to be sent
+    size_t sent = 0, filled = 0;
+    CatFactsGZip gz;
+    bool responding = false;  // a response is in progress
+    bool fresh = false;       // gzip header not yet generated
+    bool generated = false;   // the last chunk of it is in the buffer
+    bool keep_alive = true;
+    bool closing = false;     // close once the buffer drains
+    size_t allowance = 0;     // drip mode: bytes left to send this tick
+
+    void append(std::string_view s) {
+        assert(filled + s.size() <= buffer.size());
+        std::copy(s.begin(), s.end(), buffer.begin() + filled);
+        filled += s.size();
+    }
+};
+
+enum class Flush { kDrained, kBlocked, kFailed };
+
+uint64_t now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+class Worker {
+   public:
+    Worker(ServerOptions const& options, int id)
+        : options_(options),
+          next_seed_(options.seed + (uint64_t(id) << 48)),
+          wheel_(now_ms()) {
+        if (dripping()) {
+            scratch_.resize(kChunkHead + options.drip_bytes + kChunkSafety + 16);
+        }
+    }
+
+    void run() {
+        listen_fd_ = listen_socket(options_.port);
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+
+        epoll_event events[kMaxEvents];
+        for (;;) {
+            int timeout = int(wheel_.ticks_until_next());
+            int n = epoll_wait(epoll_fd_, events, kMaxEvents, timeout);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < n; ++i) {
+                auto* conn = static_cast<Connection*>(events[i].data.ptr);
+                if (conn == nullptr) {
+                    accept_all();
+                    continue;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    close(conn);
+                    continue;
+                }
+                if ((events[i].events & EPOLLIN) && !receive(*conn)) {
+                    close(conn);
+                    continue;
+                }
+                if (!pump(*conn)) close(conn);
+            }
+            wheel_.advance(now_ms(), [this](TimerNode& node) {
+                drip(static_cast<Connection&>(node));
+            });
+        }
+    }
+
+   private:
+    bool dripping() const { return options_.drip_interval > 0; }
+
+    static int listen_socket(uint16_t port) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+                || listen(fd, SOMAXCONN) < 0) {
+            perror("bind/listen");
+            exit(EXIT_FAILURE);
+        }
+        return fd;
+    }
+
+    void accept_all() {
+        for (;;) {
+            int fd = accept4(listen_fd_, nullptr, nullptr,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    perror("accept4");
+                }
+                return;
+            }
+            auto* conn = new Connection(fd);
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = conn;
+            if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                perror("epoll_ctl");
+                ::close(fd);
+                delete conn;
+            }
+        }
+    }
+
+    void close(Connection* conn) {
+        wheel_.cancel(*conn);
+        ::close(conn->fd);  // also removes it from the epoll set
+        delete conn;
+    }
+
+    // Drain the socket into the request buffer, returning false if the
+    // connection should be dropped.
+    bool receive(Connection& conn) {
+        char tmp[0x1000];
+        for (;;) {
+            ssize_t n = recv(conn.fd, tmp, sizeof(tmp), 0);
+            if (n == 0) return false;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            conn.request.append(tmp, n);
+            if (conn.request.size() > kMaxRequest) return false;
+        }
+    }
+
+    // Start the response to the next complete request, if there is one.
+    bool next_request(Connection& conn) {
+        size_t end = conn.request.find("\r\n\r\n");
+        if (end == std::string::npos) return false;
+        std::string head = conn.request.substr(0, end);
+        conn.request.erase(0, end + 4);
+        std::transform(head.begin(), head.end(), head.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+
+        conn.sent = conn.filled = 0;
+        conn.buffer.resize(dripping() ? kResponseRoom : kBufferSize);
+        if (!head.starts_with("get ")) {
+            conn.append(kNotAllowed);
+            conn.closing = true;
+            return true;
+        }
+        size_t eol = head.find("\r\n");
+        conn.keep_alive = head.substr(0, eol).ends_with("http/1.1")
+                       && head.find("\nconnection: close") == std::string::npos;
+
+        conn.append(kResponseHead);
+        if (options_.sized) {
+            char line[kMaxLengthLine];
+            int n = snprintf(line, sizeof(line), "Content-Length: %zu\r\n\r\n",
+                             response_size(next_seed_));
+            conn.append(std::string_view(line, n));
+        } else {
+            conn.append(kChunked);
+        }
+        conn.gz = CatFactsGZip();
+        conn.gz.seed(next_seed_);
+        next_seed_ += UINT64_C(0x9e3779b97f4a7c15);
+        conn.responding = true;
+        conn.fresh = true;
+        conn.generated = false;
+        conn.allowance = 0;
+        if (dripping()) {
+            wheel_.schedule(conn, wheel_.now() + 1);
+        } else {
+            conn.filled += fill_chunk(conn, std::span(conn.buffer).subspan(conn.filled), kChunkLimit);
+        }
+        return true;
+    }
+
+    // The gzip length of the response fill_chunk() will generate from
+    // `seed`: a dry run of the same entries, which only counts.
+    size_t response_size(uint64_t seed) const {
+        CatFactsSize size;
+        size.head();
+        size.seed(seed);
+        while (std::get<0>(size.tell()) < options_.length) {
+            catfacts.do_something(size);
+        }
+        size.tail();
+        return size.size();
+    }
+
+    // Write at least `limit` bytes of generator output (or what remains of
+    // the response) into `dest` as one chunk, plus the terminating chunk if
+    // the response is complete.  With a Content-Length there's no chunk
+    // framing, just the output.  Returns the number of bytes written.
+    size_t fill_chunk(Connection& conn, std::span<uint8_t> dest, size_t limit) {
+        CatFactsGZip& gz = conn.gz;
+        gz.reset(dest.subspan(options_.sized ? 0 : kChunkHead));
+        if (conn.fresh) {
+            gz.head(time(NULL));
+            conn.fresh = false;
+        }
+        while (std::get<0>(gz.tell()) < options_.length && gz.size() < limit) {
+            catfacts.do_something(gz);
+        }
+        conn.generated = std::get<0>(gz.tell()) >= options_.length;
+        if (conn.generated) gz.tail();
+        assert(gz.size() < limit + kChunkSafety);
+        if (options_.sized) return gz.size();
+
+        char size[kChunkHead + 1];
+        snprintf(size, sizeof(size), "%04zx\r\n", gz.size());
+        std::copy(size, size + kChunkHead, dest.begin());
+        size_t n = kChunkHead + gz.size();
+        std::string_view trailer = conn.generated ? "\r\n0\r\n\r\n" : "\r\n";
+        assert(n + trailer.size() <= dest.size());
+        std::copy(trailer.begin(), trailer.end(), dest.begin() + n);
+        return n + trailer.size();
+    }
+
+    // Send pending output.  A dripping response is held to what is left
+    // of the tick's allowance, whichever path gets here.
+    Flush flush(Connection& conn) {
+        bool metered = dripping() && conn.responding;
+        while (conn.sent < conn.filled) {
+            size_t len = conn.filled - conn.sent;
+            if (metered) {
+                if (conn.allowance == 0) return Flush::kBlocked;
+                len = std::min(len, conn.allowance);
+            }
+            ssize_t n = send(conn.fd, conn.buffer.data() + conn.sent, len, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return Flush::kBlocked;
+                return Flush::kFailed;
+            }
+            conn.sent += n;
+            if (metered) conn.allowance -= n;
+        }
+        conn.sent = conn.filled = 0;
+        return Flush::kDrained;
+    }
+
+    // Write out whatever the socket will take, generating more as the
+    // buffer drains.  A dripping response only gets as far as the tick's
+    // allowance, generating just enough to cover it; what that overshoots
+    // by goes out first on the next tick.  Returns false if the connection
+    // should be dropped.
+    bool pump(Connection& conn) {
+        for (;;) {
+            switch (flush(conn)) {
+            case Flush::kFailed: return false;
+            case Flush::kBlocked: return true;
+            case Flush::kDrained: break;
+            }
+            if (conn.closing) return false;
+            if (conn.responding && !conn.generated) {
+                if (dripping()) {
+                    if (conn.allowance == 0) return true;
+                    size_t n = fill_chunk(conn, scratch_, conn.allowance);
+                    conn.buffer.assign(scratch_.begin(), scratch_.begin() + n);
+                    conn.filled = n;
+                } else {
+                    conn.filled = fill_chunk(conn, conn.buffer, kChunkLimit);
+                }
+                continue;
+            }
+            if (conn.responding) {
+                conn.responding = false;
+                if (!conn.keep_alive) return false;
+            }
+            if (!next_request(conn)) return true;
+        }
+    }
+
+    // Timer callback in drip mode: send the next tick's worth of the
+    // response.  The allowance doesn't accumulate, so a tick the socket
+    // was too full for is lost rather than sent in a burst later.
+    void drip(Connection& conn) {
+        conn.allowance = options_.drip_bytes;
+        if (!pump(conn)) {
+            close(&conn);
+            return;
+        }
+        if (conn.responding && !conn.scheduled()) {
+            wheel_.schedule(conn, wheel_.now() + options_.drip_interval);
+        }
+    }
+
+    ServerOptions const& options_;
+    uint64_t next_seed_;
+    TimerWheel<> wheel_;
+    std::vector<uint8_t> scratch_;  // shared by all dripping connections
+    int listen_fd_ = -1;
+    int epoll_fd_ = -1;
+};
+
+}  // namespace
+
+int serve(ServerOptions const& options) {
+    int workers = options.workers;
+    if (workers <= 0) workers = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+
+    std::vector<std::thread> threads;
+    for (int id = 0; id < workers; ++id) {
+        threads.emplace_back([&options, id]() { Worker(options, id).run(); });
+    }
+    for (auto& t : threads) t.join();
+    return 0;
+}
@@ -0,0 +1,28 @@
+#if !defined(SERVER_H_INCLUDED)
+#define SERVER_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+struct ServerOptions {
+    uint16_t port = 8080;
+    size_t length = 32768;  // uncompressed bytes per response
+    uint64_t seed = 1;
+    int workers = 0;  // 0: one per online CPU
+    // Trickle each response out at drip_bytes per drip_interval ms rather
+    // than as fast as the client will take it; 0 disables.
+    int drip_interval = 0;
+    size_t drip_bytes = 64;
+    // Send a Content-Length, found by a dry run of each response (see
+    // SizeOnlyWith), instead of chunked encoding.
+    bool sized = false;
+};
+
+// Serve gzip-encoded generator output over HTTP/1.1 until killed.  Each
+// worker thread runs its own epoll loop on its own SO_REUSEPORT listening
+// socket, so the kernel spreads connections across them.  In drip mode
+// the output is paced by a timer wheel, and idle connections hold no
+// buffers beyond their encoder state.
+int serve(ServerOptions const& options);
+
+#endif  // !defined(SERVER_H_INCLUDED)
@@ -0,0 +1,156 @@
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sink.h"
+
+OutputSink::OutputSink(int fd, size_t limit, size_t headroom, int buffers, size_t history,
+                       bool splice)
+        : fd_(fd), mode_(Mode::kWrite), limit_(limit), ring_(history > 0 ? 1 : buffers) {
+    assert(buffers >= 2);
+    size_t page = sysconf(_SC_PAGESIZE);
+    capacity_ = (limit + headroom + page - 1) & ~(page - 1);
+
+    struct stat st;
+    int pipe_size = 0;
+    if (fd < 0) {
+        mode_ = Mode::kDiscard;
+    } else if (splice && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        // Once vmsplice() of a buffer returns, all of it is in the pipe, so
+        // if the pipe holds no more than limit() bytes everything before it
+        // has been read out.  The remaining buffers cover the pipe reader's
+        // copy in flight.  (See sink.h for why the reader must copy.)
+        int size = fcntl(fd, F_SETPIPE_SZ, int(limit));
+        if (size > 0 && size_t(size) <= limit * (buffers - 1)) {
+            mode_ = Mode::kSplice;
+            pipe_size = size;
+        }
+    }
+
+    if (history > 0) {
+        // A buffer overwrites what was written mirror_size_ bytes before
+        // it, which must be neither history nor still in the pipe.
+        size_t keep = std::max(history, size_t(pipe_size));
+        map_mirror((capacity_ + keep + page - 1) & ~(page - 1));
+        return;
+    }
+    for (auto& buf : ring_) {
+        void* p = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        buf = static_cast<uint8_t*>(p);
+    }
+}
+
+OutputSink::~OutputSink() {
+    write_pending();
+    if (mirror_size_ > 0) {
+        munmap(ring_[0], 3 * mirror_size_);
+        return;
+    }
+    for (auto buf : ring_) munmap(buf, capacity_);
+}
+
+// Three views of one memfd, so that buffer(), which starts in the middle
+// one, can reach a whole ring's length either side of it.
+void OutputSink::map_mirror(size_t size) {
+    int fd = memfd_create("output-ring", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        perror("memfd_create");
+        exit(EXIT_FAILURE);
+    }
+    void* base = mmap(nullptr, 3 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 3; ++i) {
+        void* view = static_cast<uint8_t*>(base) + i * size;
+        if (mmap(view, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+    ring_[0] = static_cast<uint8_t*>(base);
+    mirror_size_ = size;
+}
+
+std::span<uint8_t> OutputSink::flush(size_t size) {
+    assert(size <= capacity_);
+    iovec iov{buffer().data(), size};
+    switch (mode_) {
+    case Mode::kDiscard:
+        break;
+    case Mode::kSplice:
+        splice_all(iov);
+        break;
+    case Mode::kWrite:
+        pending_.push_back(iov);
+        if (pending_.size() == ring_.size()) write_pending();
+        break;
+    }
+    current_ = (current_ + 1) % ring_.size();
+    written_ += size;
+    return buffer();
+}
+
+void OutputSink::finish(size_t size) {
+    flush(size);
+    write_pending();
+}
+
+void OutputSink::write(std::span<const uint8_t> data) {
+    if (mode_ == Mode::kDiscard) return;
+    write_pending();
+    iovec iov{const_cast<uint8_t*>(data.data()), data.size()};
+    write_all(&iov, 1);
+}
+
+void OutputSink::write_pending() {
+    if (pending_.empty()) return;
+    write_all(pending_.data(), pending_.size());
+    pending_.clear();
+}
+
+void OutputSink::write_all(iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd_, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("writev");
+            exit(EXIT_FAILURE);
+        }
+        while (count > 0 && size_t(n) >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+void OutputSink::splice_all(iovec iov) {
+    while (iov.iov_len > 0) {
+        ssize_t n = vmsplice(fd_, &iov, 1, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("vmsplice");
+            exit(EXIT_FAILURE);
+        }
+        iov.iov_base = static_cast<uint8_t*>(iov.iov_base) + n;
+        iov.iov_len -= n;
+    }
+}
@@ -0,0 +1,81 @@
+#if !defined(SINK_H_INCLUDED)
+#define SINK_H_INCLUDED
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include <sys/uio.h>
+
+// Output buffers for an encoder's ByteStuffer, and the means of getting
+// them to a file descriptor without going through stdio.
+//
+// The encoder fills buffer() until it passes limit() (each buffer has
+// `headroom` bytes beyond that for whatever it emits before it next gets
+// checked), then calls flush() to hand off what it wrote and get the next
+// buffer in the ring.  Filled buffers are collected and written with one
+// writev() per trip around the ring.  A descriptor of -1 discards
+// everything, which shows how much of the total cost is I/O.
+//
+// With `splice` set and a pipe for the descriptor, the pages are instead
+// passed to the kernel with vmsplice() and not copied at all; the pipe is
+// sized so that a buffer has been read out by the time it comes round
+// again.  That only holds if the reader read()s the pipe: one which
+// splice()s or tee()s it onward (pv, or straight to a file or socket)
+// keeps references to the pages after they leave the pipe, and sees them
+// overwritten.  So it's opt-in.
+//
+// With `history` set, the ring is instead one memfd mapped three times
+// over, end to end, and each buffer starts where the last one's output
+// ended: the `history` bytes before buffer() are the output just before
+// it, however the buffers fall, so an encoder can copy backrefs out of
+// them without a wrap.  Filled buffers are written out straight away.
+class OutputSink {
+   public:
+    explicit OutputSink(int fd, size_t limit = 0x100000,
+                        size_t headroom = 0x4000, int buffers = 4,
+                        size_t history = 0, bool splice = false);
+    ~OutputSink();
+    OutputSink(OutputSink const&) = delete;
+    OutputSink& operator=(OutputSink const&) = delete;
+
+    size_t limit() const { return limit_; }
+    std::span<uint8_t> buffer() const {
+        if (mirror_size_ > 0) return {ring_[0] + mirror_size_ + written_ % mirror_size_, capacity_};
+        return {ring_[current_], capacity_};
+    }
+    // How many bytes of earlier output are intact before buffer().
+    size_t history() const {
+        return mirror_size_ > 0 ? std::min<uint64_t>(written_, mirror_size_ - capacity_) : 0;
+    }
+
+    // Hand off the first `size` bytes of the current buffer, and return
+    // the next one.
+    std::span<uint8_t> flush(size_t size);
+    // Hand off the final `size` bytes and write out anything pending.
+    void finish(size_t size);
+    // Write out data from somewhere other than buffer().
+    void write(std::span<const uint8_t> data);
+
+   private:
+    enum class Mode { kDiscard, kSplice, kWrite };
+
+    void map_mirror(size_t size);
+    void write_pending();
+    void write_all(iovec* iov, int count);
+    void splice_all(iovec iov);
+
+    int fd_;
+    Mode mode_;
+    size_t limit_;
+    size_t capacity_;
+    std::vector<uint8_t*> ring_;
+    std::vector<iovec> pending_;
+    size_t current_ = 0;
+    size_t mirror_size_ = 0;  // of the memfd, when mirrored
+    uint64_t written_ = 0;    // through the mirrored ring
+};
+
+#endif  // !defined(SINK_H_INCLUDED)
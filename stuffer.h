@@ -24,6 +24,12 @@ struct ByteStuffer {
     constexpr size_t size() const { return end() - begin(); }
     constexpr size_t done() const { return size(); }
     constexpr void clear() { ptr_ = storage_.data(); }
+    // Drop everything after the first `size` bytes.
+    constexpr void rewind(size_t size) { ptr_ = storage_.data() + size; }
+    constexpr void rebind(std::span<uint8_t> output) {
+        storage_ = output;
+        ptr_ = output.data();
+    }
 
     constexpr void wr4(uint32_t x) {
         __builtin_memcpy(ptr_, &x, sizeof(x));
@@ -34,6 +40,11 @@ struct ByteStuffer {
         __builtin_memcpy(ptr_, &x, sizeof(x));
         ptr_ += 3;
     }
+    // The low n bytes of x, with wr3()'s tail corruption.
+    constexpr void wrn(uint32_t x, int n) {
+        __builtin_memcpy(ptr_, &x, sizeof(x));
+        ptr_ += n;
+    }
     constexpr void wr2(uint16_t x) {
         __builtin_memcpy(ptr_, &x, sizeof(x));
         ptr_ += sizeof(x);
@@ -50,6 +61,96 @@ struct ByteStuffer {
     uint8_t* ptr_ = nullptr;
 };
 
+// Counts what a ByteStuffer would have written, without writing it: for
+// sizing a stream before generating it (see SizeOnlyWith).  There is no
+// storage, so begin() and end() are null.
+struct CountStuffer {
+    constexpr CountStuffer() {}
+    constexpr CountStuffer(std::span<uint8_t>) {}
+    constexpr uint8_t* begin() const { return nullptr; }
+    constexpr uint8_t* end() const { return nullptr; }
+    constexpr size_t size() const { return count_; }
+    constexpr size_t done() const { return size(); }
+    constexpr void clear() { count_ = 0; }
+    constexpr void rewind(size_t size) { count_ = size; }
+    constexpr void rebind(std::span<uint8_t>) { count_ = 0; }
+
+    constexpr void wr4(uint32_t) { count_ += 4; }
+    constexpr void wr3(uint32_t) { count_ += 3; }
+    constexpr void wrn(uint32_t, int n) { count_ += n; }
+    constexpr void wr2(uint16_t) { count_ += 2; }
+    constexpr void wr1(uint8_t) { count_ += 1; }
+    constexpr void wr(std::span<const uint8_t> x) { count_ += x.size(); }
+
+   private:
+    size_t count_ = 0;
+};
+
+// Whole nibbles, low half of each byte first (the order deflate packs
+// bits in).  A half-filled byte is held at end() with its upper nibble
+// zero, and isn't counted in size() until it is completed or padded; it
+// carries over through clear() and rebind().  Like wr4(), writes may
+// scribble up to 8 bytes past end().
+struct NibbleStuffer : public ByteStuffer {
+    NibbleStuffer() {}
+    constexpr NibbleStuffer(std::span<uint8_t> output) : ByteStuffer(output) {}
+    constexpr bool aligned() const { return !half_; }
+    constexpr void clear() {
+        carry(storage_.data());
+    }
+    constexpr void rebind(std::span<uint8_t> output) {
+        carry(output.data());
+        storage_ = output;
+    }
+
+    // Up to 15 nibbles, in the low bits of `bits`.
+    constexpr void wr_nibbles(int n, uint64_t bits) {
+        uint64_t x = half_ ? (bits << 4) | *ptr_ : bits;
+        __builtin_memcpy(ptr_, &x, sizeof(x));
+        advance(n);
+    }
+
+    // `s` holds a run of s.size() - 1 nibbles twice: first starting on a
+    // byte boundary (in s.size() / 2 bytes), then starting half a byte in
+    // (in the rest).  See Defl4bit::encode_literal().
+    constexpr void wr_literal(std::span<const uint8_t> s) {
+        size_t phase0 = s.size() / 2;
+        if (half_) {
+            uint8_t low = *ptr_;
+            __builtin_memcpy(ptr_, s.data() + phase0, s.size() - phase0);
+            *ptr_ |= low;
+        } else {
+            __builtin_memcpy(ptr_, s.data(), phase0);
+        }
+        advance(s.size() - 1);
+    }
+
+    // The first `n` nibbles of `s`, from a byte boundary.
+    constexpr void wr_aligned(std::span<const uint8_t> s, size_t n) {
+        assert(!half_ && s.size() == (n + 1) / 2);
+        __builtin_memcpy(ptr_, s.data(), s.size());
+        advance(n);
+    }
+
+    // Complete any half-filled byte with zeroes.
+    constexpr void pad() {
+        if (half_) advance(1);
+    }
+
+   private:
+    constexpr void advance(size_t n) {
+        n += half_;
+        ptr_ += n >> 1;
+        half_ = n & 1;
+    }
+    constexpr void carry(uint8_t* dest) {
+        if (half_) *dest = *ptr_;
+        ptr_ = dest;
+    }
+
+    bool half_ = false;
+};
+
 struct BitStuffer : private ByteStuffer {
     constexpr BitStuffer(std::span<uint8_t> output) : ByteStuffer(output) {}
     constexpr BitStuffer(ByteStuffer const& bs) : ByteStuffer(bs) {}
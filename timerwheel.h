@@ -0,0 +1,138 @@
+#if !defined(TIMERWHEEL_H_INCLUDED)
+#define TIMERWHEEL_H_INCLUDED
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+// Intrusive; embed (or inherit) one of these in anything that needs a
+// timer.  A node can be on at most one wheel at a time.
+struct TimerNode {
+    constexpr bool scheduled() const { return pprev_ != nullptr; }
+    constexpr uint64_t expiry() const { return expiry_; }
+
+   private:
+    template <int, int>
+    friend class TimerWheel;
+    TimerNode* next_ = nullptr;
+    TimerNode** pprev_ = nullptr;
+    uint64_t expiry_ = 0;
+};
+
+// Hierarchical timer wheel with kLevels levels of 2^kSlotBits slots each.
+// Scheduling and cancelling are O(1), and nodes are only touched when they
+// expire or when their slot cascades down to the next level, so idle
+// timers cost nothing per tick.
+template <int kLevels = 4, int kSlotBits = 8>
+class TimerWheel {
+    static constexpr uint64_t kSlots = uint64_t(1) << kSlotBits;
+    static constexpr uint64_t kMask = kSlots - 1;
+    static constexpr int kRangeBits = kLevels * kSlotBits;
+    static_assert(kRangeBits < 64);
+
+   public:
+    explicit TimerWheel(uint64_t now = 0) : now_(now) {}
+    TimerWheel(TimerWheel const&) = delete;
+    TimerWheel& operator=(TimerWheel const&) = delete;
+
+    uint64_t now() const { return now_; }
+    size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+
+    // Expiries in the past fire on the next tick; expiries beyond the
+    // range of the wheel are clamped to the end of it.
+    void schedule(TimerNode& node, uint64_t expiry) {
+        if (node.scheduled()) cancel(node);
+        if (expiry <= now_) expiry = now_ + 1;
+        if ((expiry >> kRangeBits) != (now_ >> kRangeBits)) {
+            expiry = now_ | ((uint64_t(1) << kRangeBits) - 1);
+        }
+        node.expiry_ = expiry;
+        insert(node);
+        count_++;
+    }
+
+    void cancel(TimerNode& node) {
+        if (!node.scheduled()) return;
+        unlink(node);
+        count_--;
+    }
+
+    // Step the wheel forward to `now`, calling fire(node) for each node as
+    // it expires.  fire() may reschedule the node or cancel any other node.
+    template <typename F>
+    void advance(uint64_t now, F&& fire) {
+        if (empty()) {
+            if (now > now_) now_ = now;
+            return;
+        }
+        while (now_ < now) {
+            uint64_t t = ++now_;
+            for (int level = kLevels - 1; level > 0; --level) {
+                if ((t & ((uint64_t(1) << (level * kSlotBits)) - 1)) == 0) {
+                    cascade(level, (t >> (level * kSlotBits)) & kMask);
+                }
+            }
+            TimerNode*& head = slots_[0][t & kMask];
+            while (head != nullptr) {
+                TimerNode& node = *head;
+                assert(node.expiry_ == t);
+                unlink(node);
+                count_--;
+                fire(node);
+            }
+        }
+    }
+
+    // Ticks until the wheel next needs attention (either a timer firing or
+    // a cascade), or -1 if it is empty.
+    int64_t ticks_until_next() const {
+        if (empty()) return -1;
+        uint64_t end = (now_ | kMask) + 1;
+        for (uint64_t t = now_ + 1; t < end; ++t) {
+            if (slots_[0][t & kMask] != nullptr) return t - now_;
+        }
+        return end - now_;
+    }
+
+   private:
+    void insert(TimerNode& node) {
+        // Use the lowest level at which the expiry shares its parent slot
+        // with the current time; the slot it lands in is then guaranteed to
+        // be reached (by firing or by cascade) no later than the expiry.
+        int level = 0;
+        while (level < kLevels - 1
+               && (node.expiry_ >> ((level + 1) * kSlotBits))
+                       != (now_ >> ((level + 1) * kSlotBits))) {
+            ++level;
+        }
+        TimerNode*& head = slots_[level][(node.expiry_ >> (level * kSlotBits)) & kMask];
+        node.next_ = head;
+        node.pprev_ = &head;
+        if (head != nullptr) head->pprev_ = &node.next_;
+        head = &node;
+    }
+
+    static void unlink(TimerNode& node) {
+        *node.pprev_ = node.next_;
+        if (node.next_ != nullptr) node.next_->pprev_ = node.pprev_;
+        node.next_ = nullptr;
+        node.pprev_ = nullptr;
+    }
+
+    void cascade(int level, uint64_t slot) {
+        TimerNode* list = slots_[level][slot];
+        slots_[level][slot] = nullptr;
+        while (list != nullptr) {
+            TimerNode& node = *list;
+            list = node.next_;
+            insert(node);
+        }
+    }
+
+    TimerNode* slots_[kLevels][kSlots] = {};
+    uint64_t now_;
+    size_t count_ = 0;
+};
+
+#endif  // !defined(TIMERWHEEL_H_INCLUDED)